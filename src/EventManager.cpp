@@ -1,11 +1,19 @@
-#include "EventManager.h"
+#include "EventManager.hpp"
 
 #include <SDL3/SDL_events.h>
+#include <SDL3/SDL_timer.h>
 
+#include <array>
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
-#include <deque>
 #include <phosg/Strings.hh>
+#include <stdexcept>
+#include <unordered_set>
+#include <vector>
 
+#include "InputLog.hpp"
+#include "MemoryManager.hpp"
 #include "Types.hpp"
 #include "WindowManager.hpp"
 
@@ -22,6 +30,28 @@ static constexpr uint16_t EVMOD_COMMAND_KEY_DOWN = 0x0100;
 static constexpr uint16_t EVMOD_MOUSE_BUTTON_UP = 0x0080;
 static constexpr uint16_t EVMOD_WINDOW_ACTIVATED = 0x0001;
 
+// Virtual key codes for modifier keys, which appear in GetKeys but never in
+// key events
+static constexpr uint8_t MAC_VK_COMMAND = 0x37;
+static constexpr uint8_t MAC_VK_SHIFT = 0x38;
+static constexpr uint8_t MAC_VK_CAPS_LOCK = 0x39;
+static constexpr uint8_t MAC_VK_OPTION = 0x3A;
+static constexpr uint8_t MAC_VK_CONTROL = 0x3B;
+static constexpr uint8_t MAC_VK_RIGHT_SHIFT = 0x3C;
+static constexpr uint8_t MAC_VK_RIGHT_OPTION = 0x3D;
+static constexpr uint8_t MAC_VK_RIGHT_CONTROL = 0x3E;
+
+// Button, StillDown, WaitMouseUp and GetKeys answer from the input state kept
+// by the event pump, and only pump events themselves if it hasn't run in this
+// long. Realmz calls these in tight loops, and pumping SDL on every call is
+// far more expensive than the calls themselves.
+static constexpr uint64_t INPUT_STATE_MAX_AGE_NS = 1000000000 / 60;
+
+// See SetAnimationSpeed. When animations run faster than real time, frames are
+// presented at most this often.
+static uint16_t animation_speed_percent = 100;
+static constexpr uint64_t FAST_ANIMATION_PRESENT_INTERVAL_NS = 1000000000 / 60;
+
 static const std::unordered_map<SDL_Keycode, uint16_t> mac_vk_code_for_sdl_keycode({
     // This maps SDL key codes to Classic Mac OS virtual key codes. (Note that
     // these are not the same as hardware key codes; those are generally hidden
@@ -254,7 +284,7 @@ std::array<std::array<uint8_t, 0x80>, 8> kchr_0_tables{{
 }};
 // clang-format on
 
-static uint32_t mac_message_for_sdl_key_code(SDL_Keycode key, uint16_t modifier_flags) {
+uint32_t mac_message_for_sdl_key_code_reference(SDL_Keycode key, uint16_t modifier_flags) {
   uint8_t virtual_keycode;
   try {
     virtual_keycode = mac_vk_code_for_sdl_keycode.at(key);
@@ -267,10 +297,71 @@ static uint32_t mac_message_for_sdl_key_code(SDL_Keycode key, uint16_t modifier_
   return (virtual_keycode << 8) | char_code;
 }
 
+// Dense version of mac_vk_code_for_sdl_keycode, built from it on first use.
+// SDL key codes for printable characters are the characters themselves, and
+// all others are scancodes with SDLK_SCANCODE_MASK set, so two arrays cover
+// every key in the map.
+class VirtualKeyTable {
+public:
+  static constexpr int16_t NO_KEY = -1;
+
+  static const VirtualKeyTable& instance() {
+    static const VirtualKeyTable table;
+    return table;
+  }
+
+  inline int16_t vk_for_sdl_key_code(SDL_Keycode key) const {
+    if (key < this->vk_for_char.size()) {
+      return this->vk_for_char[key];
+    }
+    if ((key & ~SDLK_SCANCODE_MASK) < this->vk_for_scancode.size() && (key & SDLK_SCANCODE_MASK)) {
+      return this->vk_for_scancode[key & ~SDLK_SCANCODE_MASK];
+    }
+    return NO_KEY;
+  }
+
+private:
+  std::array<int16_t, 0x80> vk_for_char;
+  std::array<int16_t, SDL_SCANCODE_COUNT> vk_for_scancode;
+
+  VirtualKeyTable() {
+    this->vk_for_char.fill(NO_KEY);
+    this->vk_for_scancode.fill(NO_KEY);
+    for (const auto& [key, vk] : mac_vk_code_for_sdl_keycode) {
+      if (vk >= kchr_0_tables[0].size()) {
+        throw std::logic_error(std::format("Virtual key code {:02X} is out of range", vk));
+      }
+      if (key < this->vk_for_char.size()) {
+        this->vk_for_char[key] = vk;
+      } else if ((key & SDLK_SCANCODE_MASK) && ((key & ~SDLK_SCANCODE_MASK) < this->vk_for_scancode.size())) {
+        this->vk_for_scancode[key & ~SDLK_SCANCODE_MASK] = vk;
+      } else {
+        throw std::logic_error(std::format("SDL key code {:08X} cannot be stored in the virtual key table", key));
+      }
+    }
+  }
+};
+
+uint32_t mac_message_for_sdl_key_code(SDL_Keycode key, uint16_t modifier_flags) {
+  int16_t virtual_keycode = VirtualKeyTable::instance().vk_for_sdl_key_code(key);
+  if (virtual_keycode == VirtualKeyTable::NO_KEY) {
+    return 0;
+  }
+  uint8_t char_code = kchr_0_tables[kchr_0_modifiers_table[(modifier_flags >> 8) & 0xFF]][virtual_keycode];
+  return (virtual_keycode << 8) | char_code;
+}
+
 uint8_t mac_vk_from_message(uint32_t message) {
   return (uint8_t)(message >> 8);
 }
 
+// SDL event type used by WakeEventLoop. SDL_RegisterEvents is thread-safe, as
+// is the initialization of this static.
+static uint32_t wake_sdl_event_type() {
+  static const uint32_t type = SDL_RegisterEvents(1);
+  return type;
+}
+
 std::string name_for_event_type(uint16_t what) {
   switch (what) {
     case nullEvent:
@@ -310,6 +401,184 @@ std::string name_for_event_type(uint16_t what) {
   }
 }
 
+// Maximum time SystemTask waits for input. Realmz calls SystemTask in loops
+// that also animate, so this shouldn't be longer than the fixed delay it
+// replaced.
+static constexpr int32_t SYSTEM_TASK_WAIT_MS = 10;
+// Maximum time WaitForInput waits. It's meant to wait until there's something
+// to do, so this is only a backstop for anything that isn't scheduled.
+static constexpr int32_t WAIT_FOR_INPUT_MAX_MS = 1000;
+
+static std::vector<std::pair<size_t, IdleCallback>> idle_callbacks;
+static size_t next_idle_callback_id = 1;
+
+size_t add_idle_callback(IdleCallback cb) {
+  size_t id = next_idle_callback_id++;
+  idle_callbacks.emplace_back(id, std::move(cb));
+  return id;
+}
+
+void remove_idle_callback(size_t id) {
+  std::erase_if(idle_callbacks, [id](const auto& it) { return it.first == id; });
+}
+
+// Pending timers, as a min-heap ordered by deadline. Cancelled timers stay in
+// the heap until they reach the top, but are removed from active_timer_ids so
+// they don't run.
+struct Timer {
+  uint64_t deadline_ns;
+  size_t id;
+  TimerCallback cb;
+
+  bool operator>(const Timer& other) const {
+    return this->deadline_ns > other.deadline_ns;
+  }
+};
+static std::vector<Timer> timers;
+static std::unordered_set<size_t> active_timer_ids;
+static size_t next_timer_id = 1;
+
+size_t add_timer(uint64_t deadline_ns, TimerCallback cb) {
+  size_t id = next_timer_id++;
+  timers.emplace_back(Timer{deadline_ns, id, std::move(cb)});
+  std::push_heap(timers.begin(), timers.end(), std::greater<Timer>());
+  active_timer_ids.emplace(id);
+  return id;
+}
+
+void cancel_timer(size_t id) {
+  active_timer_ids.erase(id);
+}
+
+static Timer pop_timer() {
+  std::pop_heap(timers.begin(), timers.end(), std::greater<Timer>());
+  Timer ret = std::move(timers.back());
+  timers.pop_back();
+  return ret;
+}
+
+// Runs all timers whose deadlines have passed and returns the time in real
+// milliseconds until the next one is due, or -1 if none are pending (or the
+// clock is frozen, so none will ever be due)
+static int32_t run_due_timers() {
+  auto& clock = VirtualClock::instance();
+  // Timers added by callbacks with deadlines that have already passed run on
+  // the next call, not this one, so a callback can't keep this loop going
+  uint64_t now_ns = clock.now_ns();
+  while (!timers.empty() && (timers.front().deadline_ns <= now_ns)) {
+    Timer timer = pop_timer();
+    if (active_timer_ids.erase(timer.id)) {
+      timer.cb();
+    }
+  }
+  while (!timers.empty() && !active_timer_ids.count(timers.front().id)) {
+    pop_timer();
+  }
+
+  double scale = clock.get_scale();
+  if (timers.empty() || (scale == 0.0)) {
+    return -1;
+  }
+  now_ns = clock.now_ns();
+  uint64_t deadline_ns = timers.front().deadline_ns;
+  if (deadline_ns <= now_ns) {
+    return 0;
+  }
+  double real_ms = static_cast<double>(deadline_ns - now_ns) / (scale * 1000000.0);
+  return static_cast<int32_t>(std::min<double>(std::ceil(real_ms), INT32_MAX));
+}
+
+// Runs all idle callbacks and due timers, and returns the shortest time until
+// any of them needs to run again, or -1 if none of them have anything
+// scheduled
+static int32_t run_idle_callbacks() {
+  int32_t ret = run_due_timers();
+  if (idle_callbacks.empty()) {
+    return ret;
+  }
+  // Callbacks may add or remove callbacks, so iterate over a copy
+  auto callbacks = idle_callbacks;
+  for (const auto& [_, cb] : callbacks) {
+    int32_t next_ms = cb();
+    if (next_ms >= 0 && (ret < 0 || next_ms < ret)) {
+      ret = next_ms;
+    }
+  }
+  return ret;
+}
+
+// Returns the lesser of two wait times, where negative means forever
+static int32_t min_wait_ms(int32_t a, int32_t b) {
+  if (a < 0) {
+    return b;
+  }
+  if (b < 0) {
+    return a;
+  }
+  return std::min(a, b);
+}
+
+// Pending events, oldest first. Like the Classic Mac OS event queue, this has
+// a fixed capacity, and when it's full the oldest event is discarded to make
+// room for the new one.
+class EventQueue {
+public:
+  static constexpr size_t CAPACITY = 128;
+
+  inline bool empty() const {
+    return this->count == 0;
+  }
+  inline size_t size() const {
+    return this->count;
+  }
+  // index 0 is the oldest event
+  inline EventRecord& at(size_t index) {
+    return this->records[(this->head + index) % CAPACITY];
+  }
+  inline const EventRecord& at(size_t index) const {
+    return this->records[(this->head + index) % CAPACITY];
+  }
+
+  // Returns true if an event had to be dropped to make room
+  bool push_back(const EventRecord& ev) {
+    bool dropped = (this->count == CAPACITY);
+    if (dropped) {
+      this->head = (this->head + 1) % CAPACITY;
+      this->count--;
+    }
+    this->records[(this->head + this->count) % CAPACITY] = ev;
+    this->count++;
+    return dropped;
+  }
+  EventRecord pop_front() {
+    if (this->count == 0) {
+      throw std::logic_error("Event queue is empty");
+    }
+    EventRecord ret = this->records[this->head];
+    this->head = (this->head + 1) % CAPACITY;
+    this->count--;
+    return ret;
+  }
+  void erase(size_t index) {
+    if (index >= this->count) {
+      throw std::out_of_range("Event queue index out of range");
+    }
+    for (size_t z = index; z + 1 < this->count; z++) {
+      this->at(z) = this->at(z + 1);
+    }
+    this->count--;
+  }
+  void clear() {
+    this->head = 0;
+    this->count = 0;
+  }
+
+private:
+  std::array<EventRecord, CAPACITY> records;
+  size_t head = 0;
+  size_t count = 0;
+};
+
 class EventManager {
 public:
   EventManager() = default;
@@ -321,21 +590,75 @@ public:
     em_log.debug_f("Event queue cleared");
   }
 
-  EventRecord get_next_event(uint32_t wait_ms) {
-    this->enqueue_pending_events(wait_ms);
+  // If wait_ms is negative, waits until an event arrives. Also returns early
+  // (with a null event) if WakeEventLoop is called.
+  EventRecord get_next_event(int32_t wait_ms) {
+    // The game is about to look for input, so whatever it last drew should be
+    // on the screen
+    WindowManager::instance().present_if_pending();
+    // This is also a point at which the game doesn't hold pointers into any
+    // purgeable handles (if it follows the Memory Manager's rules)
+    purge_handles_over_budget();
+
+    auto& input_log = InputLog::instance();
+    if (input_log.is_replaying()) {
+      // Live input is ignored during a replay, but SDL events still have to be
+      // processed to keep the window responsive
+      this->enqueue_pending_events(0);
+      this->event_queue.clear();
+      return input_log.on_event(this->make_null_event());
+    }
+    return input_log.on_event(this->get_next_live_event(wait_ms));
+  }
+
+  EventRecord get_next_live_event(int32_t wait_ms) {
+    uint64_t deadline_ns = SDL_GetTicksNS() + static_cast<uint64_t>(std::max<int32_t>(wait_ms, 0)) * 1000000;
+    this->woken = false;
+    for (;;) {
+      // Only block if there isn't already an event ready to return, and don't
+      // block past the time any idle callback needs to run again
+      int32_t this_wait_ms = 0;
+      if (this->event_queue.empty() && wait_ms != 0) {
+        int32_t remaining_ms = -1;
+        if (wait_ms > 0) {
+          uint64_t now_ns = SDL_GetTicksNS();
+          remaining_ms = (now_ns < deadline_ns) ? ((deadline_ns - now_ns + 999999) / 1000000) : 0;
+        }
+        this_wait_ms = (remaining_ms == 0) ? 0 : min_wait_ms(run_idle_callbacks(), remaining_ms);
+      }
+      this->enqueue_pending_events(this_wait_ms);
+      if (!this->event_queue.empty() || this->woken || (wait_ms == 0) ||
+          ((wait_ms > 0) && (SDL_GetTicksNS() >= deadline_ns))) {
+        break;
+      }
+    }
+
     if (this->event_queue.empty()) {
       return this->make_null_event();
     } else {
-      EventRecord ev = this->event_queue.front();
-      this->event_queue.pop_front();
+      EventRecord ev = this->event_queue.pop_front();
+      this->stats.dequeued++;
       em_log.debug_f("Dequeued event (what={}, message=0x{:08X}, when=0x{:08X}, where=(h={}, v={}), modifiers=0x{:04X})", name_for_event_type(ev.what), ev.message, ev.when, ev.where.h, ev.where.v, ev.modifiers);
       return ev;
     }
   }
 
+  // Waits up to max_wait_ms for input to arrive (or less if an idle callback
+  // needs to run sooner), but doesn't dequeue anything
+  void wait_for_input(int32_t max_wait_ms) {
+    WindowManager::instance().present_if_pending();
+    // Replays are paced by the recorded tick counts instead
+    if (InputLog::instance().is_replaying()) {
+      max_wait_ms = 0;
+    }
+    int32_t wait_ms = this->event_queue.empty() ? min_wait_ms(run_idle_callbacks(), max_wait_ms) : 0;
+    this->enqueue_pending_events(wait_ms);
+  }
+
   void push_menu_event(int16_t menu_id, int16_t item_id) {
     Point where = {static_cast<int16_t>(-menu_id), static_cast<int16_t>(-item_id)};
-    const auto& ev = this->event_queue.emplace_back(EventRecord{mouseDown, 0, 0, where, 0});
+    EventRecord ev{mouseDown, 0, 0, where, 0};
+    this->push_event(ev);
     em_log.debug_f("Enqueued menu event (what={}, message=0x{:08X}, when=0x{:08X}, where=(h={}, v={}), modifiers=0x{:04X})", name_for_event_type(ev.what), ev.message, ev.when, ev.where.h, ev.where.v, ev.modifiers);
   }
 
@@ -350,12 +673,38 @@ public:
     // There is at least one place where Realmz busy-loops calling Button
     // (which returns true if the mouse button is down) but does not process
     // events between those calls. In our implementation, we must process
-    // events to detect any state change in the mouse button, so we do so here
-    this->enqueue_pending_events(0);
+    // events to detect any state change in the mouse button, but once per
+    // tick is enough
+    this->refresh_input_state();
     return !(this->modifier_flags & EVMOD_MOUSE_BUTTON_UP);
   }
+
+  // Implements WaitMouseUp: like StillDown, but if the button has been
+  // released, also removes the mouseUp event from the queue
+  bool wait_mouse_up() {
+    if (this->is_mouse_button_down() && !this->any_mouse_events_pending()) {
+      return true;
+    }
+    for (size_t z = 0; z < this->event_queue.size(); z++) {
+      uint16_t what = this->event_queue.at(z).what;
+      if (what == mouseDown) {
+        break;
+      }
+      if (what == mouseUp) {
+        this->event_queue.erase(z);
+        break;
+      }
+    }
+    return false;
+  }
+
+  void get_keys(KeyMap keys) {
+    this->refresh_input_state();
+    memcpy(keys, this->key_map.data(), this->key_map.size());
+  }
   bool any_mouse_events_pending() const {
-    for (const auto& ev : this->event_queue) {
+    for (size_t z = 0; z < this->event_queue.size(); z++) {
+      const auto& ev = this->event_queue.at(z);
       if (ev.what == mouseUp || ev.what == mouseDown) {
         return true;
       }
@@ -368,10 +717,39 @@ public:
     this->mouse_loc = pt;
   }
 
+  EventQueueStats get_stats() const {
+    EventQueueStats ret = this->stats;
+    ret.pending = this->event_queue.size();
+    return ret;
+  }
+
 protected:
   Point mouse_loc = {0, 0};
   uint16_t modifier_flags = EVMOD_MOUSE_BUTTON_UP | EVMOD_WINDOW_ACTIVATED;
-  std::deque<EventRecord> event_queue;
+  EventQueue event_queue;
+  EventQueueStats stats;
+  bool woken = false;
+  uint64_t last_pump_ns = 0;
+  // Keys currently held down, in the same layout as KeyMap
+  std::array<uint8_t, 16> key_map = {};
+
+  void refresh_input_state() {
+    if (SDL_GetTicksNS() - this->last_pump_ns >= INPUT_STATE_MAX_AGE_NS) {
+      WindowManager::instance().present_if_pending();
+      this->enqueue_pending_events(0);
+    }
+  }
+
+  void set_key_down(uint8_t vk, bool down) {
+    if (vk >= 0x80) {
+      return;
+    }
+    if (down) {
+      this->key_map[vk >> 3] |= (1 << (vk & 7));
+    } else {
+      this->key_map[vk >> 3] &= ~(1 << (vk & 7));
+    }
+  }
 
   void set_modifier_value(uint16_t what, bool enabled) {
     if (enabled) {
@@ -385,17 +763,52 @@ protected:
     return {
         .what = nullEvent,
         .message = 0,
-        .when = TickCount(),
+        .when = VirtualClock::instance().now_ticks(),
         .where = this->mouse_loc,
         .modifiers = this->modifier_flags,
     };
   }
 
+  void push_event(const EventRecord& ev) {
+    this->stats.enqueued++;
+    if (this->event_queue.push_back(ev)) {
+      this->stats.dropped++;
+      em_log.warning_f("Event queue is full; dropped the oldest event");
+    }
+  }
+
+  // Key repeats, update events and activate events only tell the game that
+  // something needs to be done, so if an identical one is already waiting, we
+  // update it in place instead of adding another. This keeps a held-down key
+  // from building up a backlog of repeats that would keep running after the
+  // key is released.
+  bool merge_into_pending_event(uint16_t what, uint32_t message, void* window_port) {
+    if (what != autoKey && what != updateEvt && what != activateEvt) {
+      return false;
+    }
+    for (size_t z = this->event_queue.size(); z > 0; z--) {
+      auto& ev = this->event_queue.at(z - 1);
+      if (ev.what == what && ev.message == message && ev.window_port == window_port) {
+        ev.when = VirtualClock::instance().now_ticks();
+        ev.where = this->mouse_loc;
+        ev.modifiers = this->modifier_flags;
+        this->stats.merged++;
+        em_log.debug_f("Merged event into pending event (what={}, message=0x{:08X})", name_for_event_type(what), message);
+        return true;
+      }
+    }
+    return false;
+  }
+
   void enqueue_event(uint16_t what, uint32_t message, void* window_port, const char* text) {
-    auto& ev = this->event_queue.emplace_back();
+    if (this->merge_into_pending_event(what, message, window_port)) {
+      return;
+    }
+
+    EventRecord ev{};
     ev.what = what;
     ev.message = message;
-    ev.when = TickCount();
+    ev.when = VirtualClock::instance().now_ticks();
     ev.where = this->mouse_loc;
     ev.modifiers = this->modifier_flags;
     ev.window_port = window_port;
@@ -405,11 +818,14 @@ protected:
 
 #ifdef REALMZ_DEBUG
     // Debugging features: the backslash key switches all windows to partially-transparent to debug compositing issues;
-    // this makes rendering much slower since it recomposites and alpha-blends all windows every time
+    // this makes rendering much slower since it recomposites and alpha-blends all windows every time. It also writes
+    // the memory statistics to the log.
     if ((ev.what == keyDown) && ((ev.message & 0xFF) == static_cast<uint8_t>('\\'))) {
       WindowManager::instance().on_debug_signal();
+      DumpMemStats();
     }
 #endif
+    this->push_event(ev);
     em_log.debug_f("Enqueued event (what={}, message=0x{:08X}, when=0x{:08X}, where=(h={}, v={}), modifiers=0x{:04X})", name_for_event_type(ev.what), ev.message, ev.when, ev.where.h, ev.where.v, ev.modifiers);
   }
 
@@ -422,9 +838,9 @@ protected:
         break;
       case SDL_EVENT_KEY_DOWN:
       case SDL_EVENT_KEY_UP: {
-        em_log.info_f("{} mod={:04X} key={:08X}",
+        em_log.debug_f("{} mod={:04X} key={:08X} repeat={}",
             (e.type == SDL_EVENT_KEY_UP) ? "SDL_EVENT_KEY_UP" : "SDL_EVENT_KEY_DOWN",
-            e.key.mod, e.key.key);
+            e.key.mod, e.key.key, e.key.repeat);
         this->set_modifier_value(EVMOD_RIGHT_CONTROL_KEY_DOWN, e.key.mod & SDL_KMOD_RCTRL);
         this->set_modifier_value(EVMOD_RIGHT_OPTION_KEY_DOWN, e.key.mod & SDL_KMOD_RALT);
         this->set_modifier_value(EVMOD_RIGHT_SHIFT_KEY_DOWN, e.key.mod & SDL_KMOD_RSHIFT);
@@ -434,11 +850,27 @@ protected:
         this->set_modifier_value(EVMOD_SHIFT_KEY_DOWN, e.key.mod & SDL_KMOD_LSHIFT);
         this->set_modifier_value(EVMOD_COMMAND_KEY_DOWN, e.key.mod & SDL_KMOD_GUI);
 
+        this->set_key_down(MAC_VK_COMMAND, e.key.mod & SDL_KMOD_GUI);
+        this->set_key_down(MAC_VK_SHIFT, e.key.mod & SDL_KMOD_LSHIFT);
+        this->set_key_down(MAC_VK_CAPS_LOCK, e.key.mod & SDL_KMOD_CAPS);
+        this->set_key_down(MAC_VK_OPTION, e.key.mod & SDL_KMOD_LALT);
+        this->set_key_down(MAC_VK_CONTROL, e.key.mod & SDL_KMOD_LCTRL);
+        this->set_key_down(MAC_VK_RIGHT_SHIFT, e.key.mod & SDL_KMOD_RSHIFT);
+        this->set_key_down(MAC_VK_RIGHT_OPTION, e.key.mod & SDL_KMOD_RALT);
+        this->set_key_down(MAC_VK_RIGHT_CONTROL, e.key.mod & SDL_KMOD_RCTRL);
+        int16_t vk = VirtualKeyTable::instance().vk_for_sdl_key_code(e.key.key);
+        if (vk != VirtualKeyTable::NO_KEY) {
+          this->set_key_down(vk, e.type == SDL_EVENT_KEY_DOWN);
+        }
+
         uint32_t message = mac_message_for_sdl_key_code(e.key.key, this->modifier_flags);
         if (message != 0) {
           // TODO: Do keyboard events always go to the front window, or is
           // there some notion of keyboard focus in Classic Mac OS?
-          this->enqueue_event((e.type == SDL_EVENT_KEY_DOWN) ? keyDown : keyUp, message, FrontWindow(), "");
+          // As on Classic Mac OS, keys that are held down repeat as autoKey
+          // events rather than keyDown events
+          uint16_t what = (e.type == SDL_EVENT_KEY_UP) ? keyUp : (e.key.repeat ? autoKey : keyDown);
+          this->enqueue_event(what, message, FrontWindow(), "");
         } else {
           em_log.warning_f("Unknown key pressed: key=0x{:X} scancode=0x{:X}",
               static_cast<size_t>(e.key.key), static_cast<size_t>(e.key.scancode));
@@ -447,13 +879,15 @@ protected:
       }
       case SDL_EVENT_MOUSE_MOTION:
         // Classic Mac OS doesn't have a mouse motion event, so we just track
-        // the location and ignore it otherwise
+        // the location and ignore it otherwise. Any number of motion events
+        // between two polls collapse into the latest location.
         this->mouse_loc.h = e.motion.x;
         this->mouse_loc.v = e.motion.y;
+        this->stats.motion_coalesced++;
         break;
       case SDL_EVENT_MOUSE_BUTTON_DOWN:
       case SDL_EVENT_MOUSE_BUTTON_UP:
-        em_log.info_f("{} {} {} {:g} {:g}",
+        em_log.debug_f("{} {} {} {:g} {:g}",
             (e.type == SDL_EVENT_MOUSE_BUTTON_UP) ? "SDL_EVENT_MOUSE_BUTTON_UP" : "SDL_EVENT_MOUSE_BUTTON_DOWN",
             e.button.button, e.button.clicks, e.button.x, e.button.y);
         // Ignore events for all mouse buttons except the primary (left) button
@@ -467,7 +901,7 @@ protected:
         break;
       case SDL_EVENT_TEXT_EDITING:
       case SDL_EVENT_TEXT_INPUT:
-        em_log.info_f("{} {}",
+        em_log.debug_f("{} {}",
             (e.type == SDL_EVENT_TEXT_EDITING) ? "SDL_EVENT_TEXT_EDITING" : "SDL_EVENT_TEXT_INPUT", e.text.text);
 
         // We can use the otherwise unused app4Evt to signal a text input event, the handling of which
@@ -477,28 +911,170 @@ protected:
         this->enqueue_event(app4Evt, 0, FrontWindow(), e.text.text);
         break;
       default:
-        em_log.debug_f("Unhandled SDL event type 0x{:X}", e.type);
+        if (e.type == wake_sdl_event_type()) {
+          // This event only exists to interrupt SDL_WaitEventTimeout
+          em_log.debug_f("Woken up by WakeEventLoop");
+          this->woken = true;
+        } else {
+          em_log.debug_f("Unhandled SDL event type 0x{:X}", e.type);
+        }
     }
   }
 
   void enqueue_pending_events(int32_t wait_ms) {
     SDL_Event e;
 
-    // If wait_ms > 0, wait for at least one event to be available before
-    // enqueuing all remaining events
-    if ((wait_ms > 0) && SDL_WaitEventTimeout(&e, wait_ms)) {
+    // If wait_ms is nonzero, wait for at least one event to be available
+    // before enqueuing all remaining events. A negative value makes SDL wait
+    // indefinitely.
+    if ((wait_ms != 0) && SDL_WaitEventTimeout(&e, wait_ms)) {
       this->enqueue_sdl_event(e);
     }
     while (SDL_PollEvent(&e)) {
       this->enqueue_sdl_event(e);
     }
+    this->last_pump_ns = SDL_GetTicksNS();
   }
 };
 
 EventManager em;
 
+VirtualClock& VirtualClock::instance() {
+  static VirtualClock clock;
+  return clock;
+}
+
+VirtualClock::VirtualClock()
+    : base_real_ns(SDL_GetTicksNS()),
+      base_virtual_ns(0),
+      scale(1.0) {}
+
+uint64_t VirtualClock::now_ns() {
+  uint64_t real_elapsed_ns = SDL_GetTicksNS() - this->base_real_ns;
+  if (this->scale == 1.0) {
+    return this->base_virtual_ns + real_elapsed_ns;
+  }
+  return this->base_virtual_ns + static_cast<uint64_t>(static_cast<double>(real_elapsed_ns) * this->scale);
+}
+
+uint32_t VirtualClock::now_ticks() {
+  return (this->now_ns() * 60) / 1000000000;
+}
+
+void VirtualClock::rebase() {
+  this->base_virtual_ns = this->now_ns();
+  this->base_real_ns = SDL_GetTicksNS();
+}
+
+void VirtualClock::set_scale(double scale) {
+  if (scale < 0.0) {
+    throw std::invalid_argument("Clock scale cannot be negative");
+  }
+  this->rebase();
+  this->scale = scale;
+}
+
+void VirtualClock::advance_ns(uint64_t ns) {
+  this->rebase();
+  this->base_virtual_ns += ns;
+}
+
 uint32_t TickCount(void) {
-  return (clock() * 60) / CLOCKS_PER_SEC;
+  return InputLog::instance().on_tick_count(VirtualClock::instance().now_ticks());
+}
+
+static UnsignedWide unsigned_wide_for_u64(uint64_t v) {
+  return UnsignedWide{.hi = static_cast<UInt32>(v >> 32), .lo = static_cast<UInt32>(v)};
+}
+
+void Microseconds(UnsignedWide* microTickCount) {
+  *microTickCount = unsigned_wide_for_u64(VirtualClock::instance().now_ns() / 1000);
+}
+
+AbsoluteTime UpTime(void) {
+  return unsigned_wide_for_u64(VirtualClock::instance().now_ns());
+}
+
+Nanoseconds AbsoluteToNanoseconds(AbsoluteTime absoluteTime) {
+  return absoluteTime;
+}
+
+// Most of a delay is spent in SDL_DelayNS, but the OS may oversleep by a
+// millisecond or two, so the last part of the wait is a spin on the clock.
+// Sleeps are also capped so that input is pumped at least once per interval.
+static constexpr uint64_t DELAY_SPIN_NS = 2000000;
+static constexpr uint64_t DELAY_PUMP_INTERVAL_NS = 16000000;
+
+static void delay_until_ns(uint64_t target_ns) {
+  auto& clock = VirtualClock::instance();
+  for (;;) {
+    uint64_t now_ns = clock.now_ns();
+    if (now_ns >= target_ns) {
+      return;
+    }
+    // A frozen clock would never reach the target, so jump to it instead. This
+    // makes delays instant, which is what a frozen clock is for. At animation
+    // speed 0 the clock runs normally (so code that polls TickCount still
+    // sees time pass), but delays are skipped the same way.
+    double scale = clock.get_scale();
+    if (scale == 0.0 || animation_speed_percent == 0) {
+      clock.advance_ns(target_ns - now_ns);
+      em.enqueue_pending_events(0);
+      return;
+    }
+
+    uint64_t remaining_real_ns = static_cast<uint64_t>(static_cast<double>(target_ns - now_ns) / scale);
+    if (remaining_real_ns > DELAY_SPIN_NS) {
+      em.enqueue_pending_events(0);
+      SDL_DelayNS(std::min<uint64_t>(remaining_real_ns - DELAY_SPIN_NS, DELAY_PUMP_INTERVAL_NS));
+    }
+  }
+}
+
+// TickCount returns floor(now_ns * 60 / 10^9), so the first nanosecond of a
+// tick is the ceiling of tick * 10^9 / 60
+static uint64_t ns_for_tick(uint32_t tick) {
+  return (static_cast<uint64_t>(tick) * 1000000000 + 59) / 60;
+}
+
+void DelayUntilTick(uint32_t tick) {
+  delay_until_ns(ns_for_tick(tick));
+}
+
+void Delay(uint32_t numTicks, uint32_t* finalTicks) {
+  DelayUntilTick(TickCount() + numTicks);
+  if (finalTicks) {
+    *finalTicks = TickCount();
+  }
+}
+
+void SetAnimationSpeed(uint16_t percent) {
+  animation_speed_percent = percent;
+  if (!InputLog::instance().is_replaying()) {
+    VirtualClock::instance().set_scale(percent ? (percent / 100.0) : 1.0);
+  }
+  // Faster than real time, the game draws frames faster than the display can
+  // show them, so most of them are skipped
+  bool fast = (percent == 0) || (percent > 100);
+  WindowManager::instance().set_min_present_interval_ns(fast ? FAST_ANIMATION_PRESENT_INTERVAL_NS : 0);
+  em_log.info_f("Animation speed set to {}%", percent);
+}
+
+uint16_t GetAnimationSpeed(void) {
+  return animation_speed_percent;
+}
+
+void apply_animation_speed_from_environment() {
+  const char* speed_str = getenv("REALMZ_ANIMATION_SPEED");
+  if (!speed_str || !*speed_str) {
+    return;
+  }
+  char* end = nullptr;
+  unsigned long percent = strtoul(speed_str, &end, 10);
+  if (*end || percent > 0xFFFF) {
+    throw std::invalid_argument(std::format("Invalid REALMZ_ANIMATION_SPEED: {}", speed_str));
+  }
+  SetAnimationSpeed(percent);
 }
 
 uint32_t GetDblTime(void) {
@@ -511,9 +1087,14 @@ void SystemTask(void) {
   // Realmz uses GetNextEvent in hot loops in several places, but it also calls
   // SystemTask in those loops. There's nothing for SystemTask to do on modern
   // systems since we now have preemptive multitasking, but we can use this
-  // function to make the hot loops a bit less hot by sleeping for a CPU time
-  // slice or two.
-  SDL_Delay(10);
+  // function to make the hot loops a bit less hot by waiting briefly for
+  // input. The wait ends as soon as any input arrives, so the following
+  // GetNextEvent call sees it without delay.
+  em.wait_for_input(SYSTEM_TASK_WAIT_MS);
+}
+
+void WaitForInput(void) {
+  em.wait_for_input(WAIT_FOR_INPUT_MAX_MS);
 }
 
 void FlushEvents(int16_t which_mask, uint16_t stop_mask) {
@@ -542,8 +1123,9 @@ Boolean GetNextEvent(int16_t which_mask, EventRecord* ret) {
 }
 
 Boolean WaitNextEvent(int16_t which_mask, EventRecord* ret, uint32_t sleep, RgnHandle mouse_rgn) {
-  // Realmz doesn't use mask, sleep, or mouse_rgn (thankfully, since mouse_rgn
-  // would be annoying to implement!)
+  // Realmz doesn't use mask or mouse_rgn (thankfully, since mouse_rgn would be
+  // annoying to implement!). sleep is the maximum time to wait for an event,
+  // in ticks.
   if (which_mask != everyEvent) {
     throw std::logic_error(std::format("which_mask ({:04X}) masks out some events in WaitNextEvent", which_mask));
   }
@@ -551,12 +1133,32 @@ Boolean WaitNextEvent(int16_t which_mask, EventRecord* ret, uint32_t sleep, RgnH
     throw std::logic_error("mouse_rgn must be null");
   }
 
-  *ret = em.get_next_event(sleep);
+  *ret = em.get_next_event(ticks_to_ms(sleep));
   return (ret->what != nullEvent);
 }
 
+bool wait_next_event_ms(EventRecord* ev, int32_t timeout_ms) {
+  *ev = em.get_next_event(timeout_ms);
+  return (ev->what != nullEvent);
+}
+
+void WakeEventLoop(void) {
+  SDL_Event e;
+  SDL_zero(e);
+  e.type = wake_sdl_event_type();
+  if (!SDL_PushEvent(&e)) {
+    em_log.warning_f("Could not push wakeup event: {}", SDL_GetError());
+  }
+}
+
+void WakeEventLoopAtTick(uint32_t tick) {
+  // Nothing needs to happen when the timer runs; it only exists so that the
+  // event loop doesn't wait past its deadline
+  add_timer(ns_for_tick(tick), []() -> void {});
+}
+
 void GetMouse(Point* ret) {
-  *ret = em.get_mouse_loc();
+  *ret = InputLog::instance().on_mouse_loc(em.get_mouse_loc());
 
   // GetMouse isn't actually an Event Manager function... it's a QuickDraw
   // function! So, unlike the rest of the Event Manager, it returns coordinates
@@ -568,7 +1170,7 @@ void GetMouse(Point* ret) {
 }
 
 void GetMouseGlobal(Point* ret) {
-  *ret = em.get_mouse_loc();
+  *ret = InputLog::instance().on_mouse_loc(em.get_mouse_loc());
 }
 
 void SetMouseLocation(const Point* mouseLoc) {
@@ -576,11 +1178,20 @@ void SetMouseLocation(const Point* mouseLoc) {
 }
 
 Boolean Button(void) {
-  return em.is_mouse_button_down();
+  return InputLog::instance().on_button(em.is_mouse_button_down());
 }
 
 Boolean StillDown(void) {
-  return em.is_mouse_button_down() && !em.any_mouse_events_pending();
+  return InputLog::instance().on_button(em.is_mouse_button_down() && !em.any_mouse_events_pending());
+}
+
+Boolean WaitMouseUp(void) {
+  return InputLog::instance().on_button(em.wait_mouse_up());
+}
+
+void GetKeys(KeyMap theKeys) {
+  em.get_keys(theKeys);
+  InputLog::instance().on_keys(theKeys);
 }
 
 void PushMenuEvent(int16_t menu_id, int16_t item_id) {
@@ -590,3 +1201,7 @@ void PushMenuEvent(int16_t menu_id, int16_t item_id) {
 void reset_mouse_state() {
   em.reset_mouse_state();
 }
+
+EventQueueStats get_event_queue_stats() {
+  return em.get_stats();
+}
@@ -40,7 +40,7 @@ typedef struct {
   uint16_t what;
 
   // The contents of the message field depend on the event type:
-  // keyDown/keyUp: char code in low byte, key code in next byte, upper word unused
+  // keyDown/keyUp/autoKey: char code in low byte, key code in next byte, upper word unused
   // activateEvt/updateEvt: pointer to window structure
   // diskEvt: drive number in low word, file manager result code in high word (we never generate these)
   // mouseDown/mouseUp/nullEvent: unused
@@ -73,10 +73,24 @@ typedef struct {
   char text[32];
 } EventRecord;
 
+// One bit per virtual key code: key k is bit (k & 7) of byte (k >> 3), as in
+// the original big-endian layout, so callers should test it byte by byte
+typedef UInt32 KeyMap[4];
+
 uint8_t mac_vk_from_message(uint32_t message);
 
 uint32_t TickCount(void);
+void Microseconds(UnsignedWide* microTickCount); // IM:Operating System Utilities 4-38
+// Our AbsoluteTime values are in nanoseconds, but callers shouldn't depend on
+// that; use AbsoluteToNanoseconds to convert them
+AbsoluteTime UpTime(void);
+Nanoseconds AbsoluteToNanoseconds(AbsoluteTime absoluteTime);
 uint32_t GetDblTime(void);
+// Waits until numTicks ticks have passed, then sets *finalTicks (if not null)
+// to the current tick count. This sleeps rather than spinning, and pending
+// input is still collected while it waits.
+void Delay(uint32_t numTicks, uint32_t* finalTicks); // IM:Operating System Utilities 4-38
+void DelayUntilTick(uint32_t tick); // extension (not part of original API)
 void SystemTask(void);
 // GetCaretTime (IM1-260) not used by Realmz
 
@@ -89,10 +103,29 @@ void GetMouseGlobal(Point* mouseLoc); // extension (not part of original API)
 void SetMouseLocation(const Point* mouseLoc); // extension (not part of original API)
 Boolean Button(void); // IM1-259
 Boolean StillDown(void); // IM1-259
+Boolean WaitMouseUp(void); // IM1-259
+void GetKeys(KeyMap theKeys); // IM1-259
 
 void FlushEvents(int16_t mask, uint16_t stop_mask); // IM2-69
 
 Boolean WaitNextEvent(int16_t mask, EventRecord* ev, uint32_t sleep, RgnHandle mouse_rgn);
+// Wakes up a blocked WaitNextEvent or ModalDialog call. Unlike the rest of
+// this API, this may be called from any thread.
+void WakeEventLoop(void); // extension (not part of original API)
+// Ends any wait in the event loop (as WakeEventLoop does) once TickCount
+// reaches tick
+void WakeEventLoopAtTick(uint32_t tick); // extension (not part of original API)
+// Like SystemTask, but instead of waiting only briefly for input, waits until
+// input arrives or until the next time set with WakeEventLoopAtTick
+void WaitForInput(void); // extension (not part of original API)
+
+// Sets how fast time passes for the game, as a percentage of real time. This
+// scales TickCount and everything that waits on it, so at 200% animations run
+// twice as fast. 0 means instant: delays return immediately (and TickCount
+// jumps ahead as if they had elapsed), and not every intermediate frame is
+// presented, but the last one is.
+void SetAnimationSpeed(uint16_t percent); // extension (not part of original API)
+uint16_t GetAnimationSpeed(void); // extension (not part of original API)
 
 void reset_mouse_state();
 
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "EventManager.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+
+// Returns the message field of a Classic Mac OS key event for the given SDL
+// key code and modifier flags (as in EventRecord), or 0 if the key has no Mac
+// equivalent. The reference version translates the same way, but looks up the
+// key in the source tables directly; it's slower, and exists for testing.
+uint32_t mac_message_for_sdl_key_code(SDL_Keycode key, uint16_t modifier_flags);
+uint32_t mac_message_for_sdl_key_code_reference(SDL_Keycode key, uint16_t modifier_flags);
+
+// Converts a duration in ticks (1/60 second) to milliseconds, rounding up so
+// that a nonzero number of ticks never becomes zero milliseconds
+constexpr int32_t ticks_to_ms(uint32_t ticks) {
+  return static_cast<int32_t>(std::min<uint64_t>((static_cast<uint64_t>(ticks) * 1000 + 59) / 60, INT32_MAX));
+}
+
+// The clock behind TickCount, Microseconds, UpTime and event timestamps. It
+// follows a monotonic wall clock (not CPU time), but can run faster or slower
+// than real time, or be frozen entirely, e.g. to control animation speed.
+// Changing the scale never makes the clock go backward.
+class VirtualClock {
+public:
+  static VirtualClock& instance();
+
+  // Returns the virtual time in nanoseconds since the clock was created
+  uint64_t now_ns();
+  uint32_t now_ticks();
+
+  // A scale of 1.0 is real time, 2.0 is double speed, and 0.0 freezes the
+  // clock. Negative scales are not allowed.
+  void set_scale(double scale);
+  inline double get_scale() const {
+    return this->scale;
+  }
+  // Moves virtual time forward, even if the clock is frozen
+  void advance_ns(uint64_t ns);
+
+private:
+  VirtualClock();
+
+  // Virtual time is base_virtual_ns + (real time - base_real_ns) * scale
+  uint64_t base_real_ns;
+  uint64_t base_virtual_ns;
+  double scale;
+
+  void rebase();
+};
+
+// Applies the REALMZ_ANIMATION_SPEED environment variable, if set, with
+// SetAnimationSpeed. Called during WindowManager_Init.
+void apply_animation_speed_from_environment();
+
+// Idle callbacks run whenever the event loop is about to wait for input (in
+// WaitNextEvent, ModalDialog and SystemTask). Each returns the number of
+// milliseconds until it next needs to run, or a negative number if it has
+// nothing scheduled; waits are cut short so that callbacks run on time.
+// add_idle_callback returns an ID that can be passed to remove_idle_callback.
+using IdleCallback = std::function<int32_t()>;
+size_t add_idle_callback(IdleCallback cb);
+void remove_idle_callback(size_t id);
+
+// Timers run at the same points as idle callbacks, once VirtualClock::now_ns
+// reaches their deadlines, and the nearest deadline limits how long the event
+// loop waits. add_timer returns an ID that can be passed to cancel_timer.
+using TimerCallback = std::function<void()>;
+size_t add_timer(uint64_t deadline_ns, TimerCallback cb);
+void cancel_timer(size_t id);
+
+// Counters for the event queue since startup. dropped counts events discarded
+// because the queue was full; merged counts events that were folded into an
+// identical event already in the queue (key repeats, and update and activate
+// events for the same window); motion_coalesced counts mouse motion events
+// that only moved the mouse location and never reached the queue.
+struct EventQueueStats {
+  uint64_t enqueued = 0;
+  uint64_t dequeued = 0;
+  uint64_t dropped = 0;
+  uint64_t merged = 0;
+  uint64_t motion_coalesced = 0;
+  size_t pending = 0;
+};
+EventQueueStats get_event_queue_stats();
+
+// Like WaitNextEvent, but the timeout is given in milliseconds instead of ticks.
+// A negative timeout waits until an event arrives or WakeEventLoop is called.
+// Returns false (and sets ev to a null event) if no event arrived in time.
+bool wait_next_event_ms(EventRecord* ev, int32_t timeout_ms);
@@ -10,6 +10,7 @@ static std::unordered_map<int16_t, TTF_Font*> tt_fonts_by_id;
 static std::unordered_map<int16_t, ResourceDASM::BitmapFontRenderer>
     bm_renderers_by_id;
 static std::array<std::string, 4> param_text_entries;
+static uint64_t param_text_entries_generation = 1;
 
 void init_fonts() {
   // Pre-populate Black Chancery, since it doesnt' come from the resource fork.
@@ -69,6 +70,11 @@ void ParamText(ConstStr255Param param0, ConstStr255Param param1,
   param_text_entries[1] = string_for_pstr<256>(param1);
   param_text_entries[2] = string_for_pstr<256>(param2);
   param_text_entries[3] = string_for_pstr<256>(param3);
+  param_text_entries_generation++;
+}
+
+uint64_t param_text_generation() {
+  return param_text_entries_generation;
 }
 
 std::string replace_param_text(const std::string& text) {
@@ -104,3 +110,75 @@ std::string replace_param_text(const std::string& text) {
 
   return ret;
 }
+
+const std::string& ParamTextCache::get(const std::string& text) {
+  if (!this->scanned) {
+    // This pairs up ^ characters the same way replace_param_text does, so
+    // that (for example) "^^0" is not treated as containing a marker
+    this->marker_offsets.clear();
+    this->needs_processing = false;
+    for (size_t z = 0; z < text.size(); z++) {
+      char ch = text[z];
+      if (ch == '^' && z < text.size() - 1) {
+        char index = text[++z];
+        if (index >= '0' && index <= '3') {
+          this->marker_offsets.emplace_back(z - 1);
+          this->needs_processing = true;
+        } else if (index == '\r' || index == '\0') {
+          this->needs_processing = true;
+        }
+      } else if (ch == '\r' || ch == '\0') {
+        this->needs_processing = true;
+      }
+    }
+    this->scanned = true;
+    this->generation = 0;
+  }
+
+  if (!this->needs_processing) {
+    return text;
+  }
+
+  // If there are no markers, the result doesn't depend on the param text
+  // entries, so it only needs to be built once
+  if ((this->generation != 0) &&
+      (this->marker_offsets.empty() || (this->generation == param_text_entries_generation))) {
+    return this->processed_text;
+  }
+
+  // clear() keeps the existing capacity, so after the first build this
+  // generally doesn't allocate
+  this->processed_text.clear();
+  size_t offset = 0;
+  auto append_converted = [&](size_t end_offset) -> void {
+    for (; offset < end_offset; offset++) {
+      char ch = text[offset];
+      this->processed_text.push_back((ch == '\r') ? '\n' : ch);
+    }
+  };
+  for (size_t marker_offset : this->marker_offsets) {
+    append_converted(marker_offset);
+    const auto& entry = param_text_entries[text[marker_offset + 1] - '0'];
+    if (entry.empty()) {
+      this->processed_text.push_back('^');
+      this->processed_text.push_back(text[marker_offset + 1]);
+    } else {
+      this->processed_text.append(entry);
+    }
+    offset = marker_offset + 2;
+  }
+  append_converted(text.size());
+
+  // Match replace_param_text's handling of null bytes
+  size_t zero_pos = this->processed_text.find('\0');
+  if (zero_pos != std::string::npos) {
+    this->processed_text.resize(zero_pos);
+  }
+
+  this->generation = param_text_entries_generation;
+  return this->processed_text;
+}
+
+void ParamTextCache::invalidate() {
+  this->scanned = false;
+}
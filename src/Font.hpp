@@ -2,7 +2,9 @@
 
 #include <SDL3_ttf/SDL_ttf.h>
 #include <resource_file/BitmapFontRenderer.hh>
+#include <string>
 #include <variant>
+#include <vector>
 
 #define BLACK_CHANCERY_FONT_ID 1602
 #define GENEVA_FONT_ID 1
@@ -19,3 +21,29 @@ void init_fonts();
 Font load_font(int16_t font_id);
 void set_font_style(TTF_Font* font, int16_t face);
 std::string replace_param_text(const std::string& text);
+
+// Returns a counter that changes every time ParamText is called. Anything that
+// caches substituted text can compare this against the value it saw when it
+// last substituted.
+uint64_t param_text_generation();
+
+// Caches the ParamText-substituted version of a single string (for example, a
+// dialog item's text). The source text is scanned for ^0-^3 markers once, and
+// the substituted result is rebuilt in a reused buffer only when ParamText is
+// called again. Text that contains no markers, carriage returns or null bytes
+// is returned as-is. invalidate() must be called whenever the source text
+// changes.
+class ParamTextCache {
+public:
+  ParamTextCache() = default;
+
+  const std::string& get(const std::string& text);
+  void invalidate();
+
+private:
+  bool scanned = false;
+  bool needs_processing = false;
+  uint64_t generation = 0; // Zero means the processed text has never been built
+  std::vector<size_t> marker_offsets;
+  std::string processed_text;
+};
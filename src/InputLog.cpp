@@ -0,0 +1,331 @@
+#include "InputLog.hpp"
+
+#include <SDL3/SDL_timer.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+
+#include "EventManager.hpp"
+#include "Types.hpp"
+#include "WindowManager.hpp"
+
+static phosg::PrefixedLogger il_log("[InputLog] ", DEFAULT_LOG_LEVEL);
+
+static const char LOG_SIGNATURE[4] = {'R', 'Z', 'I', 'L'};
+static constexpr uint8_t LOG_VERSION = 2;
+
+static uint32_t zigzag_encode(int32_t v) {
+  return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+}
+
+static int32_t zigzag_decode(uint32_t v) {
+  return static_cast<int32_t>(v >> 1) ^ -static_cast<int32_t>(v & 1);
+}
+
+static uint32_t pack_point(const Point& pt) {
+  return (static_cast<uint32_t>(static_cast<uint16_t>(pt.h)) << 16) | static_cast<uint16_t>(pt.v);
+}
+
+static Point unpack_point(uint32_t v) {
+  return Point{.v = static_cast<int16_t>(v & 0xFFFF), .h = static_cast<int16_t>(v >> 16)};
+}
+
+InputLog& InputLog::instance() {
+  static InputLog log;
+  return log;
+}
+
+InputLog::InputLog() : f(nullptr, &fclose) {
+  const char* record_filename = getenv("REALMZ_RECORD");
+  const char* replay_filename = getenv("REALMZ_REPLAY");
+  if (record_filename && replay_filename) {
+    throw std::runtime_error("REALMZ_RECORD and REALMZ_REPLAY cannot both be set");
+  }
+
+  if (record_filename) {
+    this->filename = record_filename;
+    this->f.reset(fopen(record_filename, "wb"));
+    if (!this->f) {
+      throw std::runtime_error(std::format("Cannot open {} for recording", record_filename));
+    }
+    this->write_bytes(LOG_SIGNATURE, sizeof(LOG_SIGNATURE));
+    this->write_bytes(&LOG_VERSION, sizeof(LOG_VERSION));
+    this->mode = Mode::RECORD;
+    il_log.info_f("Recording input to {}", this->filename);
+
+  } else if (replay_filename) {
+    this->filename = replay_filename;
+    this->f.reset(fopen(replay_filename, "rb"));
+    if (!this->f) {
+      throw std::runtime_error(std::format("Cannot open {} for replay", replay_filename));
+    }
+    char signature[sizeof(LOG_SIGNATURE)];
+    uint8_t version;
+    if ((fread(signature, sizeof(signature), 1, this->f.get()) != 1) ||
+        (fread(&version, sizeof(version), 1, this->f.get()) != 1) ||
+        memcmp(signature, LOG_SIGNATURE, sizeof(LOG_SIGNATURE)) ||
+        (version != LOG_VERSION)) {
+      throw std::runtime_error(std::format("{} is not an input log, or is from an incompatible version", replay_filename));
+    }
+    this->mode = Mode::REPLAY;
+
+    // Freezing the clock makes every delay finish immediately (see
+    // delay_until_ns); the game only sees the recorded tick counts anyway
+    const char* fast_str = getenv("REALMZ_REPLAY_FAST");
+    this->fast = fast_str && *fast_str && strcmp(fast_str, "0");
+    if (this->fast) {
+      VirtualClock::instance().set_scale(0.0);
+    }
+    il_log.info_f("Replaying input from {}{}", this->filename, this->fast ? " (fast)" : "");
+  }
+
+  this->start_ns = SDL_GetTicksNS();
+}
+
+InputLog::~InputLog() {
+  if (this->mode == Mode::RECORD) {
+    this->flush_run();
+    il_log.info_f("Recorded {} records to {}", this->num_records, this->filename);
+  }
+}
+
+void InputLog::flush_run() {
+  // Clear the run first, since write_tag flushes it
+  if (this->run_count > 0) {
+    uint64_t count = this->run_count;
+    this->run_count = 0;
+    this->write_tag(this->run_tag);
+    this->write_varint(this->run_value);
+    this->write_varint(count);
+
+  } else if (this->null_run_count > 0) {
+    uint64_t count = this->null_run_count;
+    this->null_run_count = 0;
+    this->write_tag(TAG_NULL_EVENTS);
+    this->write_varint(this->null_run_where);
+    this->write_varint(this->null_run_modifiers);
+    this->write_varint(count);
+    this->write_bytes(this->null_run_when_deltas.data(), this->null_run_when_deltas.size());
+    this->null_run_when_deltas.clear();
+  }
+}
+
+void InputLog::write_tag(uint8_t tag) {
+  this->flush_run();
+  this->write_bytes(&tag, sizeof(tag));
+  this->num_records++;
+}
+
+void InputLog::write_varint(uint64_t v) {
+  std::string data;
+  encode_varint(data, v);
+  this->write_bytes(data.data(), data.size());
+}
+
+void InputLog::encode_varint(std::string& out, uint64_t v) {
+  do {
+    out.push_back((v & 0x7F) | ((v > 0x7F) ? 0x80 : 0x00));
+    v >>= 7;
+  } while (v);
+}
+
+void InputLog::write_bytes(const void* data, size_t size) {
+  if (size && fwrite(data, size, 1, this->f.get()) != 1) {
+    throw std::runtime_error(std::format("Cannot write to {}", this->filename));
+  }
+}
+
+uint8_t InputLog::read_tag(uint8_t expected_tag, uint8_t other_expected_tag) {
+  if (this->run_count > 0) {
+    throw std::runtime_error(std::format(
+        "Replay diverged from recording: expected a {} record, but the log has {} more {} records first",
+        static_cast<char>(expected_tag), this->run_count, static_cast<char>(this->run_tag)));
+  }
+  if (this->null_run_count > 0) {
+    throw std::runtime_error(std::format(
+        "Replay diverged from recording: expected a {} record, but the log has {} more null events first",
+        static_cast<char>(expected_tag), this->null_run_count));
+  }
+  int tag = fgetc(this->f.get());
+  if (tag == EOF) {
+    this->on_replay_finished();
+  }
+  if ((tag != expected_tag) && (!other_expected_tag || (tag != other_expected_tag))) {
+    throw std::runtime_error(std::format(
+        "Replay diverged from recording: expected a {} record, but the log has a {} record at offset 0x{:X}",
+        static_cast<char>(expected_tag), static_cast<char>(tag), ftell(this->f.get()) - 1));
+  }
+  this->num_records++;
+  return tag;
+}
+
+uint64_t InputLog::read_varint() {
+  uint64_t ret = 0;
+  for (size_t shift = 0; shift < 64; shift += 7) {
+    int ch = fgetc(this->f.get());
+    if (ch == EOF) {
+      this->on_replay_finished();
+    }
+    ret |= static_cast<uint64_t>(ch & 0x7F) << shift;
+    if (!(ch & 0x80)) {
+      return ret;
+    }
+  }
+  throw std::runtime_error("Input log contains an invalid varint");
+}
+
+void InputLog::read_bytes(void* data, size_t size) {
+  if (size && fread(data, size, 1, this->f.get()) != 1) {
+    this->on_replay_finished();
+  }
+}
+
+void InputLog::on_replay_finished() {
+  double seconds = static_cast<double>(SDL_GetTicksNS() - this->start_ns) / 1000000000.0;
+  il_log.info_f("Replay of {} finished after {} records in {:g} seconds", this->filename, this->num_records, seconds);
+  exit(EXIT_SUCCESS);
+}
+
+uint32_t InputLog::record_or_replay_run(uint8_t tag, uint32_t value) {
+  if (this->mode == Mode::RECORD) {
+    if ((this->null_run_count > 0) ||
+        ((this->run_count > 0) && ((this->run_tag != tag) || (this->run_value != value)))) {
+      this->flush_run();
+    }
+    if (this->run_count == 0) {
+      this->run_tag = tag;
+      this->run_value = value;
+    }
+    this->run_count++;
+    return value;
+  }
+
+  if ((this->run_count == 0) || (this->run_tag != tag)) {
+    this->read_tag(tag);
+    this->run_tag = tag;
+    this->run_value = this->read_varint();
+    this->run_count = this->read_varint();
+  }
+  this->run_count--;
+
+  // Without REALMZ_REPLAY_FAST, don't let the game get ahead of the recording
+  if ((tag == TAG_TICKS) && !this->fast && (VirtualClock::instance().now_ticks() < this->run_value)) {
+    DelayUntilTick(this->run_value);
+  }
+  return this->run_value;
+}
+
+EventRecord InputLog::record_or_replay_event(const EventRecord& ev) {
+  if (this->mode == Mode::RECORD) {
+    // Null events never carry a message or text, but check anyway so a
+    // nonstandard one can't lose them
+    if ((ev.what == nullEvent) && (ev.message == 0) && !ev.text[0]) {
+      uint32_t where = pack_point(ev.where);
+      if ((this->run_count > 0) ||
+          ((this->null_run_count > 0) && ((this->null_run_where != where) || (this->null_run_modifiers != ev.modifiers)))) {
+        this->flush_run();
+      }
+      if (this->null_run_count == 0) {
+        this->null_run_where = where;
+        this->null_run_modifiers = ev.modifiers;
+        encode_varint(this->null_run_when_deltas, ev.when);
+      } else {
+        encode_varint(this->null_run_when_deltas, ev.when - this->null_run_when);
+      }
+      this->null_run_when = ev.when;
+      this->null_run_count++;
+      return ev;
+    }
+
+    this->write_tag(TAG_EVENT);
+    this->write_varint(ev.what);
+    this->write_varint(ev.message);
+    this->write_varint(ev.when);
+    this->write_varint(pack_point(ev.where));
+    this->write_varint(ev.modifiers);
+    size_t text_size = strnlen(ev.text, sizeof(ev.text) - 1);
+    this->write_varint(text_size);
+    this->write_bytes(ev.text, text_size);
+    return ev;
+  }
+
+  if ((this->null_run_count == 0) && (this->read_tag(TAG_EVENT, TAG_NULL_EVENTS) == TAG_NULL_EVENTS)) {
+    this->null_run_where = this->read_varint();
+    this->null_run_modifiers = this->read_varint();
+    this->null_run_count = this->read_varint();
+    if (this->null_run_count == 0) {
+      throw std::runtime_error("Input log contains an empty run of null events");
+    }
+    // The first delta is the first event's time, so start from zero
+    this->null_run_when = 0;
+  }
+  if (this->null_run_count > 0) {
+    this->null_run_count--;
+    this->null_run_when += this->read_varint();
+    EventRecord ret{};
+    ret.what = nullEvent;
+    ret.when = this->null_run_when;
+    ret.where = unpack_point(this->null_run_where);
+    ret.modifiers = this->null_run_modifiers;
+    return ret;
+  }
+
+  EventRecord ret{};
+  ret.what = this->read_varint();
+  ret.message = this->read_varint();
+  ret.when = this->read_varint();
+  ret.where = unpack_point(this->read_varint());
+  ret.modifiers = this->read_varint();
+  size_t text_size = this->read_varint();
+  if (text_size >= sizeof(ret.text)) {
+    throw std::runtime_error("Input log contains an event with too much text");
+  }
+  this->read_bytes(ret.text, text_size);
+
+  // Window pointers aren't the same from one run to the next, so find the
+  // window the same way EventManager did when the event was recorded
+  switch (ret.what) {
+    case mouseDown:
+    case mouseUp: {
+      auto window = WindowManager::instance().window_for_point(ret.where.h, ret.where.v);
+      ret.window_port = window ? &window->get_port() : nullptr;
+      break;
+    }
+    case keyDown:
+    case keyUp:
+    case autoKey:
+    case app4Evt:
+      ret.window_port = FrontWindow();
+      break;
+    default:
+      ret.window_port = nullptr;
+  }
+  return ret;
+}
+
+int16_t InputLog::record_or_replay_random(int16_t value) {
+  if (this->mode == Mode::RECORD) {
+    this->write_tag(TAG_RANDOM);
+    this->write_varint(zigzag_encode(value));
+    return value;
+  }
+  this->read_tag(TAG_RANDOM);
+  return zigzag_decode(this->read_varint());
+}
+
+Point InputLog::record_or_replay_mouse_loc(const Point& pt) {
+  return unpack_point(this->record_or_replay_run(TAG_MOUSE_LOC, pack_point(pt)));
+}
+
+void InputLog::record_or_replay_keys(KeyMap keys) {
+  if (this->mode == Mode::RECORD) {
+    this->write_tag(TAG_KEYS);
+    this->write_bytes(keys, sizeof(KeyMap));
+  } else {
+    this->read_tag(TAG_KEYS);
+    this->read_bytes(keys, sizeof(KeyMap));
+  }
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "EventManager.h"
+
+// Records everything the game reads from the outside world while it runs
+// (delivered events, TickCount values, Random values, and polled mouse and
+// keyboard state) to a file, or replays a recording. Realmz's behavior depends
+// only on these and its data files, so a replay repeats the recorded session
+// exactly, which makes recordings usable as reproducible workloads for
+// measuring changes to the game or to this library.
+//
+// To record, set REALMZ_RECORD to the name of the log file to write. To
+// replay, set REALMZ_REPLAY to the name of a log file instead. Replays run at
+// the recorded speed, unless REALMZ_REPLAY_FAST is also set, in which case
+// nothing waits and delays finish immediately. (To replay without a window,
+// also set SDL_VIDEO_DRIVER=dummy.) The process exits when a replay reaches the
+// end of the log, and if the game asks for a different kind of input than the
+// log has next, the replay has diverged from the recording and we throw.
+class InputLog {
+public:
+  enum class Mode {
+    NONE = 0,
+    RECORD,
+    REPLAY,
+  };
+
+  static InputLog& instance();
+  ~InputLog();
+
+  inline Mode get_mode() const {
+    return this->mode;
+  }
+  inline bool is_replaying() const {
+    return this->mode == Mode::REPLAY;
+  }
+
+  // Each of these takes the live value and returns the value the game should
+  // see. When recording, that's the live value (which is also written to the
+  // log); when replaying, the live value is ignored and the next value from
+  // the log is returned instead.
+  inline EventRecord on_event(const EventRecord& ev) {
+    return (this->mode == Mode::NONE) ? ev : this->record_or_replay_event(ev);
+  }
+  inline uint32_t on_tick_count(uint32_t ticks) {
+    return (this->mode == Mode::NONE) ? ticks : this->record_or_replay_run(TAG_TICKS, ticks);
+  }
+  inline int16_t on_random(int16_t value) {
+    return (this->mode == Mode::NONE) ? value : this->record_or_replay_random(value);
+  }
+  inline bool on_button(bool down) {
+    return (this->mode == Mode::NONE) ? down : this->record_or_replay_run(TAG_BUTTON, down);
+  }
+  inline Point on_mouse_loc(const Point& pt) {
+    return (this->mode == Mode::NONE) ? pt : this->record_or_replay_mouse_loc(pt);
+  }
+  inline void on_keys(KeyMap keys) {
+    if (this->mode != Mode::NONE) {
+      this->record_or_replay_keys(keys);
+    }
+  }
+
+private:
+  static constexpr uint8_t TAG_EVENT = 'E';
+  static constexpr uint8_t TAG_NULL_EVENTS = 'N';
+  static constexpr uint8_t TAG_TICKS = 'T';
+  static constexpr uint8_t TAG_RANDOM = 'R';
+  static constexpr uint8_t TAG_BUTTON = 'B';
+  static constexpr uint8_t TAG_MOUSE_LOC = 'M';
+  static constexpr uint8_t TAG_KEYS = 'K';
+
+  Mode mode = Mode::NONE;
+  bool fast = false;
+  std::string filename;
+  std::unique_ptr<FILE, decltype(&fclose)> f;
+  size_t num_records = 0;
+  uint64_t start_ns = 0;
+
+  // The game polls TickCount, Button and GetMouse in tight loops and usually
+  // gets the same value many times in a row, so these are stored as runs of
+  // (tag, value, count). When recording, the current run is written when a
+  // different value or a record of another type comes along; when replaying,
+  // it's the run being consumed.
+  uint8_t run_tag = 0;
+  uint32_t run_value = 0;
+  uint64_t run_count = 0;
+
+  // Null events come from the same polling loops, so they're stored as runs
+  // too: consecutive null events with the same mouse location and modifiers
+  // are written as one record, with each event's time stored as the number of
+  // ticks since the previous one. Only one of the two kinds of run is active
+  // at a time. When recording, null_run_when_deltas holds the encoded deltas
+  // until the run is written; when replaying, they're read from the log as
+  // the run is consumed.
+  uint32_t null_run_where = 0;
+  uint16_t null_run_modifiers = 0;
+  uint32_t null_run_when = 0;
+  uint64_t null_run_count = 0;
+  std::string null_run_when_deltas;
+
+  InputLog();
+
+  uint32_t record_or_replay_run(uint8_t tag, uint32_t value);
+  EventRecord record_or_replay_event(const EventRecord& ev);
+  int16_t record_or_replay_random(int16_t value);
+  Point record_or_replay_mouse_loc(const Point& pt);
+  void record_or_replay_keys(KeyMap keys);
+
+  void flush_run();
+  void write_tag(uint8_t tag);
+  void write_varint(uint64_t v);
+  static void encode_varint(std::string& out, uint64_t v);
+  void write_bytes(const void* data, size_t size);
+  // Reads the next record's tag and checks that it's the expected one (or
+  // other_expected_tag, if given), and returns it. Exits the process if the
+  // log is exhausted.
+  uint8_t read_tag(uint8_t expected_tag, uint8_t other_expected_tag = 0);
+  uint64_t read_varint();
+  void read_bytes(void* data, size_t size);
+  [[noreturn]] void on_replay_finished();
+};
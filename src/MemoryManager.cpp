@@ -1,27 +1,118 @@
 #include "MemoryManager.h"
 
+#include <SDL3/SDL_timer.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <format>
+#include <memory>
 #include <phosg/Random.hh>
 #include <phosg/Strings.hh>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "InputLog.hpp"
+#include "MemoryManager.hpp"
+#include "Types.hpp"
 
 using namespace std;
 
+static phosg::PrefixedLogger mm_log("[MemoryManager] ", DEFAULT_LOG_LEVEL);
+
 constexpr int16_t memFullErr = -108;
 constexpr int16_t memWZErr = -111;
 
-class MemoryManager : public std::enable_shared_from_this<MemoryManager> {
+// Data for small handles and Ptrs comes from per-size free lists instead of
+// malloc.
+// Blocks are carved out of larger chunks, which are never returned to the
+// system; freed blocks are only reused for blocks of the same size class.
+class SizeClassAllocator {
 public:
-  struct BlockMeta {
-    void* data = nullptr;
-    size_t size = 0;
-    std::weak_ptr<MemoryManager> memory_manager;
+  static constexpr uint8_t NO_CLASS = 0xFF; // Allocated with malloc instead
 
-    ~BlockMeta() {
-      if (this->data) {
-        free(this->data);
-      }
+  SizeClassAllocator() = default;
+  SizeClassAllocator(const SizeClassAllocator&) = delete;
+  SizeClassAllocator& operator=(const SizeClassAllocator&) = delete;
+  ~SizeClassAllocator() {
+    for (void* chunk : this->chunks) {
+      free(chunk);
+    }
+  }
+
+  static uint8_t class_for_size(size_t size) {
+    auto it = std::lower_bound(CLASS_SIZES.begin(), CLASS_SIZES.end(), size);
+    return (it == CLASS_SIZES.end()) ? NO_CLASS : (it - CLASS_SIZES.begin());
+  }
+
+  // Returns nullptr if memory is exhausted
+  void* alloc(uint8_t cls) {
+    if (!this->free_lists[cls] && !this->add_chunk(cls)) {
+      return nullptr;
     }
+    FreeBlock* block = this->free_lists[cls];
+    this->free_lists[cls] = block->next;
+    return block;
+  }
+
+  void free_block(void* data, uint8_t cls) {
+    FreeBlock* block = reinterpret_cast<FreeBlock*>(data);
+    block->next = this->free_lists[cls];
+    this->free_lists[cls] = block;
+  }
+
+private:
+  // All sizes are multiples of 16 so that every block is as aligned as a
+  // malloc'ed block would be
+  static constexpr std::array<size_t, 18> CLASS_SIZES = {
+      16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192};
+  static constexpr size_t CHUNK_SIZE = 0x10000;
+
+  struct FreeBlock {
+    FreeBlock* next;
   };
 
+  std::array<FreeBlock*, CLASS_SIZES.size()> free_lists = {};
+  std::vector<void*> chunks;
+
+  bool add_chunk(uint8_t cls) {
+    uint8_t* chunk = reinterpret_cast<uint8_t*>(malloc(CHUNK_SIZE));
+    if (!chunk) {
+      return false;
+    }
+    this->chunks.emplace_back(chunk);
+    size_t block_size = CLASS_SIZES[cls];
+    for (size_t offset = CHUNK_SIZE - (CHUNK_SIZE % block_size); offset >= block_size; offset -= block_size) {
+      this->free_block(chunk + offset - block_size, cls);
+    }
+    return true;
+  }
+};
+
+class MemoryManager;
+static MemoryManager& memory_manager();
+
+class MemoryManager {
+public:
+  // Every nonrelocatable block starts with one of these, and the Ptr points
+  // just past it, so a Ptr's metadata can be found without a lookup. It's 16
+  // bytes long, so the block's data is as aligned as the header is.
+  struct PtrHeader {
+    uint32_t size;
+    // LIVE_PTR_TAG while the block exists
+    uint32_t tag;
+    // SDL_GetTicks (truncated) when the block was allocated; only used for
+    // statistics
+    uint32_t alloc_ms;
+    // Which SizeClassAllocator class the block came from, or NO_CLASS if it
+    // was allocated with malloc
+    uint8_t size_class;
+    uint8_t unused[3];
+  };
+  static_assert(sizeof(PtrHeader) == 16, "PtrHeader must not affect alignment");
+
   struct HandleMeta {
     enum Flag {
       // The low 8 bits are defined in Mac OS docs. The higher flags are used by
@@ -35,117 +126,363 @@ public:
       // pointer (e.g. after an EmptyHandle call), so it doesn't suffice to
       // just check the data field for this.
       VALID = 0x8000,
+      // Set while the handle is in the purge list
+      ON_PURGE_LIST = 0x4000,
+      // Set if the handle holds data decoded from its resource instead of the
+      // resource's own data (only used for statistics)
+      DECODED = 0x2000,
+      // Set if the handle has destroy callbacks in extra_destroy_callbacks
+      EXTRA_DESTROY_CALLBACKS = 0x1000,
     };
+    // This is the master pointer, and a Handle is its address, so it must stay
+    // where it is for as long as the handle exists. It must also be the first
+    // field, so that a Handle is also the address of its HandleMeta.
     void* data = nullptr;
+    // LIVE_HANDLE_TAG while the handle exists, so handles can be validated
+    // without looking them up anywhere
+    uint32_t tag = 0;
+    // The resource type, if this is a resource handle and the Resource Manager
+    // has said what type it is (only used for statistics)
+    uint32_t res_type = 0;
     size_t size = 0;
+    uint64_t alloc_ns = 0;
     uint16_t flags = 0;
-    std::weak_ptr<MemoryManager> memory_manager;
-    std::vector<std::function<void()>> destroy_callbacks;
-
-    HandleMeta() = default;
-    HandleMeta(const HandleMeta&) = delete;
-    HandleMeta(HandleMeta&& other) = default;
-    HandleMeta& operator=(const HandleMeta&) = delete;
-    HandleMeta& operator=(HandleMeta&& other) {
-      this->run_destroy_callbacks();
-      this->data = other.data;
-      this->size = other.size;
-      this->flags = other.flags;
-      this->memory_manager = std::move(other.memory_manager);
-      this->destroy_callbacks = std::move(other.destroy_callbacks);
-      other.data = nullptr;
-      other.size = 0;
-      other.flags = 0;
-      other.memory_manager.reset();
-      other.destroy_callbacks.clear();
-      return *this;
-    }
-
-    ~HandleMeta() {
-      if (this->data) {
-        this->run_destroy_callbacks();
-        free(this->data);
-      }
-    }
+    // Which SizeClassAllocator class data came from, or NO_CLASS if it was
+    // allocated with malloc
+    uint8_t size_class = SizeClassAllocator::NO_CLASS;
+    // Next record in the slab's free list (only used while this one is free)
+    HandleMeta* next_free = nullptr;
+    // Neighbors in the purge list (only used while ON_PURGE_LIST is set)
+    HandleMeta* purge_prev = nullptr;
+    HandleMeta* purge_next = nullptr;
+    // Almost every handle has at most one destroy callback, so the first one
+    // is stored here; any others are in extra_destroy_callbacks
+    DestroyCallback destroy_callback = nullptr;
+    void* destroy_callback_context = nullptr;
+  };
 
-    void run_destroy_callbacks() {
-      for (auto it : this->destroy_callbacks) {
-        it();
+  MemoryManager() {
+    const char* budget_str = getenv("REALMZ_HANDLE_BUDGET_MB");
+    if (budget_str && *budget_str) {
+      char* end = nullptr;
+      unsigned long long budget_mb = strtoull(budget_str, &end, 10);
+      if (*end) {
+        throw std::invalid_argument(std::format("Invalid REALMZ_HANDLE_BUDGET_MB: {}", budget_str));
       }
-      this->destroy_callbacks.clear();
+      this->purge_budget_bytes = budget_mb << 20;
     }
-  };
-
-  MemoryManager() = default;
-  ~MemoryManager() = default;
+#ifdef REALMZ_DEBUG
+    // The instance is never destroyed (see memory_manager()), so report leaks
+    // from an exit handler instead of the destructor
+    atexit([]() -> void {
+      memory_manager().report_live_ptrs();
+    });
+#endif
+  }
+  MemoryManager(const MemoryManager&) = delete;
+  MemoryManager& operator=(const MemoryManager&) = delete;
 
-  void* alloc_block(size_t size) {
-    auto meta = make_shared<BlockMeta>();
-    meta->data = malloc(size);
-    if (!meta->data) {
+  Ptr alloc_ptr(size_t size) {
+    if (size > UINT32_MAX) {
+      this->last_error = memFullErr;
+      return nullptr;
+    }
+    size_t block_size = sizeof(PtrHeader) + size + PTR_GUARD_SIZE;
+    uint8_t size_class = SizeClassAllocator::class_for_size(block_size);
+    void* block = (size_class == SizeClassAllocator::NO_CLASS)
+        ? malloc(block_size)
+        : this->ptr_data_allocator.alloc(size_class);
+    if (!block) {
       this->last_error = memFullErr;
       return nullptr;
     }
-    meta->size = size;
-    meta->memory_manager = this->weak_from_this();
-    this->meta_for_block.emplace(meta->data, meta);
+
+    PtrHeader* header = reinterpret_cast<PtrHeader*>(block);
+    header->size = size;
+    header->tag = LIVE_PTR_TAG;
+    header->alloc_ms = SDL_GetTicks();
+    header->size_class = size_class;
+    Ptr ret = reinterpret_cast<Ptr>(header + 1);
+#ifdef REALMZ_DEBUG
+    memset(ret + size, PTR_GUARD_BYTE, PTR_GUARD_SIZE);
+    this->live_ptrs.emplace(header);
+#endif
+
+    auto& stats = this->category_stats[memCategoryPointer].stats;
+    count_alloc(stats);
+    count_resize(stats, 0, size);
+    this->last_error = noErr;
+    return ret;
+  }
+
+  void free_ptr(Ptr p) {
+    PtrHeader* header = this->find_ptr_header(p);
+    if (!header) {
+      this->last_error = memWZErr;
+      return;
+    }
+#ifdef REALMZ_DEBUG
+    if (!this->ptr_guard_intact(header)) {
+      throw std::logic_error(std::format("Data was written past the end of Ptr {} ({} bytes)", static_cast<void*>(p), header->size));
+    }
+    this->live_ptrs.erase(header);
+    // Make it obvious if the block is used after it's disposed
+    memset(p, PTR_FREED_BYTE, header->size);
+#endif
+
+    auto& stats = this->category_stats[memCategoryPointer].stats;
+    count_resize(stats, header->size, 0);
+    count_free(stats, static_cast<uint64_t>(static_cast<uint32_t>(SDL_GetTicks()) - header->alloc_ms) * 1000000);
+
+    header->tag = 0;
+    if (header->size_class == SizeClassAllocator::NO_CLASS) {
+      free(header);
+    } else {
+      this->ptr_data_allocator.free_block(header, header->size_class);
+    }
     this->last_error = noErr;
-    return meta->data;
   }
 
-  void free_block(void* data) {
-    this->last_error = this->meta_for_block.erase(data) ? noErr : memWZErr;
+  // Returns nullptr if p isn't a live Ptr. Like find_handle_meta, this only
+  // reads the memory just before p, so p must be a Ptr or null.
+  PtrHeader* find_ptr_header(Ptr p) const {
+    if (!p || (reinterpret_cast<uintptr_t>(p) % alignof(PtrHeader))) {
+      return nullptr;
+    }
+    PtrHeader* header = reinterpret_cast<PtrHeader*>(p) - 1;
+    return (header->tag == LIVE_PTR_TAG) ? header : nullptr;
   }
 
-  std::shared_ptr<BlockMeta> get_block_meta(void* data) const {
-    return this->meta_for_block.at(data);
+  // Sets the error code returned by MemError, and returns nullptr if p is not
+  // a live Ptr
+  PtrHeader* check_ptr_valid(Ptr p) const {
+    PtrHeader* header = this->find_ptr_header(p);
+    this->last_error = header ? noErr : memWZErr;
+    return header;
   }
 
-  Handle alloc_handle(size_t size, uint16_t flags = 0) {
-    auto meta = make_shared<HandleMeta>();
-    meta->data = malloc(size);
-    if (!meta->data) {
+  Handle alloc_handle(size_t size, uint16_t flags = 0, uint32_t res_type = 0) {
+    HandleMeta* meta = this->alloc_handle_meta();
+    if (!this->alloc_handle_data(*meta, size)) {
+      this->free_handle_meta(meta);
       this->last_error = memFullErr;
       return nullptr;
     }
-    meta->size = size;
-    meta->flags = flags;
-    meta->memory_manager = this->weak_from_this();
-    Handle handle = reinterpret_cast<Handle>(&meta->data);
-    this->meta_for_handle.emplace(handle, meta);
+    meta->flags = flags | HandleMeta::VALID;
+    meta->res_type = res_type;
+    meta->tag = LIVE_HANDLE_TAG;
+    meta->alloc_ns = SDL_GetTicksNS();
+    this->for_each_handle_stats(*meta, [](MemStats& stats) { count_alloc(stats); });
+    this->set_handle_size(*meta, size);
     this->last_error = noErr;
-    return handle;
+    return reinterpret_cast<Handle>(&meta->data);
   }
 
   void free_handle(Handle handle) {
-    this->last_error = this->meta_for_handle.erase(handle) ? noErr : memWZErr;
+    HandleMeta* meta = this->find_handle_meta(handle);
+    if (!meta) {
+      this->last_error = memWZErr;
+      return;
+    }
+    this->empty_handle(*meta);
+    uint64_t lifetime_ns = SDL_GetTicksNS() - meta->alloc_ns;
+    this->for_each_handle_stats(*meta, [&](MemStats& stats) { count_free(stats, lifetime_ns); });
+    this->free_handle_meta(meta);
+    this->last_error = noErr;
+  }
+
+  // Frees the handle's data, but leaves the handle valid. Dereferencing the
+  // handle gives nullptr until its data is replaced or resized.
+  void empty_handle(HandleMeta& meta) {
+    this->remove_from_purge_list(meta);
+    this->run_destroy_callbacks(meta);
+    this->free_handle_data(meta);
+    this->set_live_size(meta, 0);
+  }
+
+  // Changes the handle's flags and resource type, which may move it to a
+  // different category in the statistics
+  void set_handle_flags(HandleMeta& meta, uint16_t flags, uint32_t res_type) {
+    this->for_each_handle_stats(meta, [&](MemStats& stats) { remove_live(stats, meta.size); });
+    meta.flags = flags;
+    meta.res_type = res_type;
+    this->for_each_handle_stats(meta, [&](MemStats& stats) { add_live(stats, meta.size); });
+    this->update_purge_list(meta);
+  }
+
+  // Purgeable handles that aren't locked or empty are kept in a list, least
+  // recently used first. A handle moves to the end of the list when it's
+  // allocated, resized, unlocked, marked purgeable, or when touch_handle is
+  // called on it (the Resource Manager does this when a resource is fetched
+  // again). This must be called after any of those happen.
+  void update_purge_list(HandleMeta& meta) {
+    this->remove_from_purge_list(meta);
+    if (!meta.data || ((meta.flags & (HandleMeta::PURGEABLE | HandleMeta::LOCKED)) != HandleMeta::PURGEABLE)) {
+      return;
+    }
+    meta.purge_prev = this->purge_list_tail;
+    meta.purge_next = nullptr;
+    if (this->purge_list_tail) {
+      this->purge_list_tail->purge_next = &meta;
+    } else {
+      this->purge_list_head = &meta;
+    }
+    this->purge_list_tail = &meta;
+    meta.flags |= HandleMeta::ON_PURGE_LIST;
+  }
+
+  void remove_from_purge_list(HandleMeta& meta) {
+    if (!(meta.flags & HandleMeta::ON_PURGE_LIST)) {
+      return;
+    }
+    if (meta.purge_prev) {
+      meta.purge_prev->purge_next = meta.purge_next;
+    } else {
+      this->purge_list_head = meta.purge_next;
+    }
+    if (meta.purge_next) {
+      meta.purge_next->purge_prev = meta.purge_prev;
+    } else {
+      this->purge_list_tail = meta.purge_prev;
+    }
+    meta.purge_prev = nullptr;
+    meta.purge_next = nullptr;
+    meta.flags &= ~HandleMeta::ON_PURGE_LIST;
+  }
+
+  // Empties purgeable handles, least recently used first, until the total
+  // size of all handles' data is within the budget or there is nothing left
+  // that can be purged
+  void purge_to_budget() {
+    if (!this->purge_list_head || !this->purge_budget_bytes || (this->handle_data_bytes <= this->purge_budget_bytes)) {
+      return;
+    }
+    size_t num_purged = 0;
+    size_t bytes_before = this->handle_data_bytes;
+    while (this->purge_list_head && (this->handle_data_bytes > this->purge_budget_bytes)) {
+      this->empty_handle(*this->purge_list_head);
+      num_purged++;
+    }
+    mm_log.debug_f("Purged {} handles ({} bytes); {} bytes remain allocated to handles",
+        num_purged, bytes_before - this->handle_data_bytes, this->handle_data_bytes);
+  }
+
+  void set_purge_budget(size_t bytes) {
+    this->purge_budget_bytes = bytes;
+  }
+
+  void count_decoded_cache_alloc(size_t bytes) {
+    auto& stats = this->category_stats[memCategoryDecodedCache].stats;
+    count_alloc(stats);
+    count_resize(stats, 0, bytes);
+  }
+
+  void count_decoded_cache_free(size_t bytes) {
+    auto& stats = this->category_stats[memCategoryDecodedCache].stats;
+    count_resize(stats, bytes, 0);
+    // Caches don't say how long they held each object
+    count_free(stats, UNKNOWN_LIFETIME);
+  }
+
+  MemStats sample_category_stats(int16_t category) {
+    return sample_stats(this->category_stats.at(category));
+  }
+
+  MemStats sample_resource_type_stats(uint32_t type) {
+    auto it = this->resource_type_stats.find(type);
+    return (it == this->resource_type_stats.end()) ? MemStats{} : sample_stats(it->second);
+  }
+
+  void print_stats() {
+    mm_log.info_f("Handle data: {} bytes (purge budget: {} bytes; {} handles purgeable)",
+        this->handle_data_bytes, this->purge_budget_bytes, this->count_purgeable_handles());
+    for (int16_t category = 0; category < memCategoryCount; category++) {
+      mm_log.info_f("  {}: {}", CATEGORY_NAMES[category], str_for_stats(this->sample_category_stats(category)));
+    }
+
+    std::vector<std::pair<uint32_t, MemStats>> type_stats;
+    for (auto& [type, entry] : this->resource_type_stats) {
+      type_stats.emplace_back(type, sample_stats(entry));
+    }
+    std::sort(type_stats.begin(), type_stats.end(), [](const auto& a, const auto& b) {
+      return a.second.liveBytes > b.second.liveBytes;
+    });
+    mm_log.info_f("Resource handles by type (most live bytes first):");
+    for (const auto& [type, stats] : type_stats) {
+      mm_log.info_f("  {}: {}", str_for_resource_type(type), str_for_stats(stats));
+    }
   }
 
   void resize_handle(Handle handle, size_t new_size) {
-    shared_ptr<HandleMeta> meta;
+    HandleMeta* meta;
     try {
-      meta = this->get_handle_meta(handle);
+      meta = &this->get_handle_meta(handle);
     } catch (const out_of_range&) {
       this->last_error = memWZErr;
       return;
     }
 
-    void* new_data = realloc(meta->data, new_size);
-    if (!new_data) {
+    // Blocks from the size class allocator have some slack, so the block only
+    // has to move if the new size is in a different class
+    uint8_t new_size_class = SizeClassAllocator::class_for_size(new_size);
+    if ((meta->size_class != SizeClassAllocator::NO_CLASS) && (new_size_class == meta->size_class)) {
+      this->set_handle_size(*meta, new_size);
+      this->last_error = noErr;
+      return;
+    }
+
+    if ((meta->size_class == SizeClassAllocator::NO_CLASS) && (new_size_class == SizeClassAllocator::NO_CLASS)) {
+      void* new_data = realloc(meta->data, new_size);
+      if (!new_data) {
+        this->last_error = memFullErr;
+        return;
+      }
+      meta->data = new_data;
+      this->set_handle_size(*meta, new_size);
+      this->last_error = noErr;
+      return;
+    }
+
+    HandleMeta new_meta;
+    if (!this->alloc_handle_data(new_meta, new_size)) {
       this->last_error = memFullErr;
       return;
     }
-    meta->data = new_data;
-    meta->size = new_size;
+    if (meta->data) {
+      memcpy(new_meta.data, meta->data, std::min(meta->size, new_size));
+    }
+    this->free_handle_data(*meta);
+    meta->data = new_meta.data;
+    meta->size_class = new_meta.size_class;
+    this->set_handle_size(*meta, new_size);
     this->last_error = noErr;
   }
 
-  void check_handle_valid(Handle handle) const {
-    this->last_error = this->meta_for_handle.count(handle) ? noErr : memWZErr;
+  // Sets the error code returned by MemError, and returns nullptr if handle
+  // is not a live handle
+  HandleMeta* check_handle_valid(Handle handle) const {
+    HandleMeta* meta = this->find_handle_meta(handle);
+    this->last_error = meta ? noErr : memWZErr;
+    return meta;
   }
 
-  std::shared_ptr<HandleMeta> get_handle_meta(Handle handle) const {
-    return this->meta_for_handle.at(handle);
+  // Returns nullptr if handle isn't a live handle. This only reads the memory
+  // handle points to, so it's only meaningful for pointers that are either
+  // handles or null; Classic Mac OS didn't check any more thoroughly than that.
+  HandleMeta* find_handle_meta(Handle handle) const {
+    if (!handle || (reinterpret_cast<uintptr_t>(handle) % alignof(HandleMeta))) {
+      return nullptr;
+    }
+    HandleMeta* meta = reinterpret_cast<HandleMeta*>(handle);
+    return (meta->tag == LIVE_HANDLE_TAG) ? meta : nullptr;
+  }
+
+  HandleMeta& get_handle_meta(Handle handle) const {
+    HandleMeta* meta = this->find_handle_meta(handle);
+    if (!meta) {
+      throw std::out_of_range("no such handle");
+    }
+    return *meta;
   }
 
   OSErr get_last_error() const {
@@ -153,44 +490,357 @@ public:
   }
 
   void replace_handle(Handle dest, Handle src) {
-    auto src_meta_it = this->meta_for_handle.find(src);
-    if (src_meta_it == this->meta_for_handle.end()) {
-      throw std::out_of_range("no such handle");
-    }
-    auto& dest_meta = this->meta_for_handle.at(dest);
-    if (dest_meta->data) {
-      free(dest_meta->data);
+    HandleMeta* src_meta = &this->get_handle_meta(src);
+    HandleMeta& dest_meta = this->get_handle_meta(dest);
+
+    this->empty_handle(dest_meta);
+    this->remove_from_purge_list(*src_meta);
+
+    // Take the data out of src without freeing it, then free src
+    void* data = src_meta->data;
+    size_t size = src_meta->size;
+    uint8_t size_class = src_meta->size_class;
+    uint16_t flags = src_meta->flags;
+    uint32_t res_type = src_meta->res_type;
+    DestroyCallback destroy_callback = src_meta->destroy_callback;
+    void* destroy_callback_context = src_meta->destroy_callback_context;
+    if (src_meta->flags & HandleMeta::EXTRA_DESTROY_CALLBACKS) {
+      auto node = this->extra_destroy_callbacks.extract(src_meta);
+      node.key() = &dest_meta;
+      this->extra_destroy_callbacks.insert(std::move(node));
     }
-    *dest_meta = std::move(*src_meta_it->second);
-    this->meta_for_handle.erase(src_meta_it);
+    src_meta->data = nullptr;
+    this->set_live_size(*src_meta, 0);
+    uint64_t lifetime_ns = SDL_GetTicksNS() - src_meta->alloc_ns;
+    this->for_each_handle_stats(*src_meta, [&](MemStats& stats) { count_free(stats, lifetime_ns); });
+    this->free_handle_meta(src_meta);
+
+    dest_meta.data = data;
+    dest_meta.size_class = size_class;
+    dest_meta.destroy_callback = destroy_callback;
+    dest_meta.destroy_callback_context = destroy_callback_context;
+    this->set_handle_flags(dest_meta, flags, res_type);
+    this->set_handle_size(dest_meta, size);
   }
 
   void replace_handle_data(Handle handle, const void* data, size_t size) {
-    auto& meta = this->meta_for_handle.at(handle);
-    // We don't use realloc() here in case the passed-in data pointer is within the existing handle's data
-    void* new_data = malloc(size);
-    memcpy(new_data, data, size);
-    if (meta->data) {
-      free(meta->data);
+    HandleMeta& meta = this->get_handle_meta(handle);
+    // We don't reuse the existing block in case the passed-in data pointer is
+    // within it
+    HandleMeta new_meta;
+    if (!this->alloc_handle_data(new_meta, size)) {
+      throw std::bad_alloc();
+    }
+    memcpy(new_meta.data, data, size);
+    this->free_handle_data(meta);
+    meta.data = new_meta.data;
+    meta.size_class = new_meta.size_class;
+    if (meta.flags & HandleMeta::DECODED) {
+      this->set_handle_flags(meta, meta.flags & ~HandleMeta::DECODED, meta.res_type);
     }
-    meta->data = new_data;
-    meta->size = size;
+    this->set_handle_size(meta, size);
   }
 
-  void add_destroy_callback(Handle handle, std::function<void()> cb) {
-    this->meta_for_handle.at(handle)->destroy_callbacks.emplace_back(cb);
+  void touch_handle(Handle handle) {
+    HandleMeta* meta = this->find_handle_meta(handle);
+    if (meta) {
+      this->update_purge_list(*meta);
+    }
+  }
+
+  void add_destroy_callback(Handle handle, DestroyCallback cb, void* context) {
+    HandleMeta& meta = this->get_handle_meta(handle);
+    if (!meta.destroy_callback) {
+      meta.destroy_callback = cb;
+      meta.destroy_callback_context = context;
+    } else if ((meta.destroy_callback == cb) && (meta.destroy_callback_context == context)) {
+      return;
+    } else {
+      if (meta.flags & HandleMeta::EXTRA_DESTROY_CALLBACKS) {
+        const auto& extra_callbacks = this->extra_destroy_callbacks.at(&meta);
+        if (std::find(extra_callbacks.begin(), extra_callbacks.end(), std::make_pair(cb, context)) != extra_callbacks.end()) {
+          return;
+        }
+      }
+      this->extra_destroy_callbacks[&meta].emplace_back(cb, context);
+      meta.flags |= HandleMeta::EXTRA_DESTROY_CALLBACKS;
+    }
+  }
+
+  // Calls and removes all of the handle's destroy callbacks
+  void run_destroy_callbacks(HandleMeta& meta) {
+    if (!meta.destroy_callback) {
+      return; // There can't be any extra callbacks either
+    }
+    DestroyCallback cb = meta.destroy_callback;
+    void* context = meta.destroy_callback_context;
+    meta.destroy_callback = nullptr;
+    meta.destroy_callback_context = nullptr;
+    std::vector<std::pair<DestroyCallback, void*>> extra_callbacks;
+    if (meta.flags & HandleMeta::EXTRA_DESTROY_CALLBACKS) {
+      auto it = this->extra_destroy_callbacks.find(&meta);
+      extra_callbacks = std::move(it->second);
+      this->extra_destroy_callbacks.erase(it);
+      meta.flags &= ~HandleMeta::EXTRA_DESTROY_CALLBACKS;
+    }
+
+    cb(context);
+    for (const auto& [extra_cb, extra_context] : extra_callbacks) {
+      extra_cb(extra_context);
+    }
   }
 
 private:
+  // Handle records are allocated in chunks of this many, and are never freed,
+  // so a Handle (which points into its record) stays valid until the handle
+  // is disposed. Unused records are kept on a free list.
+  static constexpr size_t HANDLE_RECORDS_PER_CHUNK = 256;
+  static constexpr uint32_t LIVE_HANDLE_TAG = 0x484E444C; // 'HNDL'
+  static constexpr uint32_t LIVE_PTR_TAG = 0x50545220; // 'PTR '
+
+#ifdef REALMZ_DEBUG
+  // In debug builds, each Ptr block has this many bytes of PTR_GUARD_BYTE
+  // after its data, which are checked when it's disposed, and all live Ptrs
+  // are tracked so the ones that are never disposed can be reported at exit
+  static constexpr size_t PTR_GUARD_SIZE = 16;
+  static constexpr uint8_t PTR_GUARD_BYTE = 0xFD;
+  static constexpr uint8_t PTR_FREED_BYTE = 0xDD;
+  std::unordered_set<PtrHeader*> live_ptrs;
+
+  bool ptr_guard_intact(const PtrHeader* header) const {
+    const uint8_t* guard = reinterpret_cast<const uint8_t*>(header + 1) + header->size;
+    for (size_t z = 0; z < PTR_GUARD_SIZE; z++) {
+      if (guard[z] != PTR_GUARD_BYTE) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void report_live_ptrs() const {
+    if (this->live_ptrs.empty()) {
+      return;
+    }
+    size_t total_bytes = 0;
+    for (const auto* header : this->live_ptrs) {
+      total_bytes += header->size;
+    }
+    mm_log.info_f("{} Ptrs ({} bytes) were never disposed:", this->live_ptrs.size(), total_bytes);
+    for (const auto* header : this->live_ptrs) {
+      mm_log.info_f("  {}: {} bytes, allocated at {} ms{}",
+          static_cast<const void*>(header + 1), header->size, header->alloc_ms,
+          this->ptr_guard_intact(header) ? "" : " (data was written past the end)");
+    }
+  }
+#else
+  static constexpr size_t PTR_GUARD_SIZE = 0;
+#endif
+
   mutable OSErr last_error = noErr;
-  std::unordered_map<void*, std::shared_ptr<BlockMeta>> meta_for_block;
-  std::unordered_map<Handle, std::shared_ptr<HandleMeta>> meta_for_handle;
+  std::vector<std::unique_ptr<HandleMeta[]>> handle_chunks;
+  HandleMeta* free_handle_metas = nullptr;
+  SizeClassAllocator handle_data_allocator;
+  SizeClassAllocator ptr_data_allocator;
+  // Destroy callbacks after the first one for each handle
+  std::unordered_map<const HandleMeta*, std::vector<std::pair<DestroyCallback, void*>>> extra_destroy_callbacks;
+
+  // Total size of all handles' data, which purge_to_budget keeps within
+  // purge_budget_bytes if it can (0 means there is no budget)
+  static constexpr size_t DEFAULT_PURGE_BUDGET_BYTES = 64 << 20;
+  size_t handle_data_bytes = 0;
+  size_t purge_budget_bytes = DEFAULT_PURGE_BUDGET_BYTES;
+  HandleMeta* purge_list_head = nullptr;
+  HandleMeta* purge_list_tail = nullptr;
+
+  // Statistics. Handles count toward one of the handle categories and, if
+  // they're resource handles of a known type, toward that type as well.
+  // sample_ns and sample_alloc_count are the time and allocation count when
+  // the statistics were last sampled, for computing allocsPerSecond.
+  struct StatsEntry {
+    MemStats stats = {};
+    uint64_t sample_ns = 0;
+    uint64_t sample_alloc_count = 0;
+  };
+  static constexpr std::array<const char*, memCategoryCount> CATEGORY_NAMES = {
+      "Handles", "Resources", "Decoded resources", "Pointers", "Decoded caches"};
+  // Upper limits of the lifetime histogram buckets; the last bucket has no
+  // upper limit
+  static constexpr std::array<uint64_t, MEM_LIFETIME_BUCKETS - 1> LIFETIME_BUCKET_LIMITS_NS = {
+      10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL, 60000000000ULL, 600000000000ULL};
+  static constexpr std::array<const char*, MEM_LIFETIME_BUCKETS> LIFETIME_BUCKET_NAMES = {
+      "<10ms", "<100ms", "<1s", "<10s", "<1m", "<10m", ">=10m"};
+  static constexpr uint64_t UNKNOWN_LIFETIME = UINT64_MAX;
+  std::array<StatsEntry, memCategoryCount> category_stats;
+  std::unordered_map<uint32_t, StatsEntry> resource_type_stats;
+
+  static int16_t category_for_handle(const HandleMeta& meta) {
+    if (!(meta.flags & HandleMeta::IS_RESOURCE)) {
+      return memCategoryHandle;
+    }
+    return (meta.flags & HandleMeta::DECODED) ? memCategoryDecodedResource : memCategoryResource;
+  }
+
+  template <typename FnT>
+  void for_each_handle_stats(const HandleMeta& meta, FnT&& fn) {
+    fn(this->category_stats[category_for_handle(meta)].stats);
+    if ((meta.flags & HandleMeta::IS_RESOURCE) && meta.res_type) {
+      fn(this->resource_type_stats[meta.res_type].stats);
+    }
+  }
+
+  static void add_live(MemStats& stats, size_t size) {
+    stats.liveCount++;
+    stats.peakCount = std::max(stats.peakCount, stats.liveCount);
+    stats.liveBytes += size;
+    stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes);
+  }
+
+  static void remove_live(MemStats& stats, size_t size) {
+    stats.liveCount--;
+    stats.liveBytes -= size;
+  }
+
+  static void count_alloc(MemStats& stats) {
+    add_live(stats, 0);
+    stats.allocCount++;
+  }
+
+  static void count_free(MemStats& stats, uint64_t lifetime_ns) {
+    remove_live(stats, 0);
+    stats.freeCount++;
+    if (lifetime_ns != UNKNOWN_LIFETIME) {
+      size_t bucket = std::upper_bound(LIFETIME_BUCKET_LIMITS_NS.begin(), LIFETIME_BUCKET_LIMITS_NS.end(), lifetime_ns) -
+          LIFETIME_BUCKET_LIMITS_NS.begin();
+      stats.lifetimeCounts[bucket]++;
+    }
+  }
+
+  static void count_resize(MemStats& stats, size_t old_size, size_t new_size) {
+    stats.liveBytes = stats.liveBytes - old_size + new_size;
+    if (new_size > old_size) {
+      stats.allocBytes += new_size - old_size;
+      stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes);
+    }
+  }
+
+  static MemStats sample_stats(StatsEntry& entry) {
+    uint64_t now_ns = SDL_GetTicksNS();
+    MemStats ret = entry.stats;
+    uint64_t elapsed_ns = now_ns - entry.sample_ns;
+    ret.allocsPerSecond = elapsed_ns
+        ? (static_cast<double>(ret.allocCount - entry.sample_alloc_count) * 1000000000.0 / elapsed_ns)
+        : 0.0;
+    entry.sample_ns = now_ns;
+    entry.sample_alloc_count = ret.allocCount;
+    return ret;
+  }
+
+  static std::string str_for_stats(const MemStats& stats) {
+    std::string lifetimes;
+    for (size_t z = 0; z < MEM_LIFETIME_BUCKETS; z++) {
+      if (stats.lifetimeCounts[z]) {
+        lifetimes += std::format("{}{}:{}", lifetimes.empty() ? "" : " ", LIFETIME_BUCKET_NAMES[z], stats.lifetimeCounts[z]);
+      }
+    }
+    return std::format(
+        "{} live ({} bytes); peak {} ({} bytes); {} allocated ({} bytes; {:.1f}/sec recently); {} freed (lifetimes: {})",
+        stats.liveCount, stats.liveBytes, stats.peakCount, stats.peakBytes, stats.allocCount, stats.allocBytes,
+        stats.allocsPerSecond, stats.freeCount, lifetimes.empty() ? "none" : lifetimes);
+  }
+
+  static std::string str_for_resource_type(uint32_t type) {
+    std::string ret;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      char ch = (type >> shift) & 0xFF;
+      ret.push_back((ch >= 0x20 && ch < 0x7F) ? ch : '?');
+    }
+    return ret;
+  }
+
+  size_t count_purgeable_handles() const {
+    size_t ret = 0;
+    for (const HandleMeta* meta = this->purge_list_head; meta; meta = meta->purge_next) {
+      ret++;
+    }
+    return ret;
+  }
+
+  HandleMeta* alloc_handle_meta() {
+    if (!this->free_handle_metas) {
+      auto& chunk = this->handle_chunks.emplace_back(make_unique<HandleMeta[]>(HANDLE_RECORDS_PER_CHUNK));
+      for (size_t z = HANDLE_RECORDS_PER_CHUNK; z > 0; z--) {
+        chunk[z - 1].next_free = this->free_handle_metas;
+        this->free_handle_metas = &chunk[z - 1];
+      }
+    }
+    HandleMeta* meta = this->free_handle_metas;
+    this->free_handle_metas = meta->next_free;
+    meta->next_free = nullptr;
+    return meta;
+  }
+
+  void free_handle_meta(HandleMeta* meta) {
+    meta->data = nullptr;
+    meta->tag = 0;
+    meta->res_type = 0;
+    meta->size = 0;
+    meta->flags = 0;
+    meta->size_class = SizeClassAllocator::NO_CLASS;
+    meta->destroy_callback = nullptr;
+    meta->destroy_callback_context = nullptr;
+    meta->purge_prev = nullptr;
+    meta->purge_next = nullptr;
+    meta->next_free = this->free_handle_metas;
+    this->free_handle_metas = meta;
+  }
+
+  // Sets meta.data and meta.size_class, but not meta.size. Returns false if
+  // memory is exhausted.
+  bool alloc_handle_data(HandleMeta& meta, size_t size) {
+    meta.size_class = SizeClassAllocator::class_for_size(size);
+    if (meta.size_class == SizeClassAllocator::NO_CLASS) {
+      meta.data = malloc(size);
+    } else {
+      meta.data = this->handle_data_allocator.alloc(meta.size_class);
+    }
+    return (meta.data != nullptr);
+  }
+
+  // Sets meta.size after its data was (re)allocated, and counts it as used
+  void set_handle_size(HandleMeta& meta, size_t size) {
+    this->set_live_size(meta, size);
+    this->update_purge_list(meta);
+  }
+
+  void set_live_size(HandleMeta& meta, size_t size) {
+    this->handle_data_bytes = this->handle_data_bytes - meta.size + size;
+    this->for_each_handle_stats(meta, [&](MemStats& stats) { count_resize(stats, meta.size, size); });
+    meta.size = size;
+  }
+
+  void free_handle_data(HandleMeta& meta) {
+    if (meta.data) {
+      if (meta.size_class == SizeClassAllocator::NO_CLASS) {
+        free(meta.data);
+      } else {
+        this->handle_data_allocator.free_block(meta.data, meta.size_class);
+      }
+    }
+    meta.data = nullptr;
+    meta.size_class = SizeClassAllocator::NO_CLASS;
+  }
 };
 
-static MemoryManager memory_manager;
+// This is never destroyed, since other static objects (e.g. QuickDraw's
+// pixel buffer pool) free memory and update its statistics during static
+// destruction
+static MemoryManager& memory_manager() {
+  static auto* mm = new MemoryManager();
+  return *mm;
+}
 
 Handle NewHandle(Size size) {
-  return reinterpret_cast<Handle>(memory_manager.alloc_handle(size));
+  return reinterpret_cast<Handle>(memory_manager().alloc_handle(size));
 }
 
 Handle NewHandleClear(Size size) {
@@ -210,43 +860,143 @@ Handle NewHandleWithData(const void* data, size_t size) {
 }
 
 void DisposeHandle(Handle handle) {
-  memory_manager.free_handle(handle);
+  memory_manager().free_handle(handle);
+}
+
+Ptr NewPtr(Size size) {
+  return memory_manager().alloc_ptr(size);
+}
+
+Ptr NewPtrClear(Size size) {
+  Ptr ret = NewPtr(size);
+  if (ret) {
+    memset(ret, 0, size);
+  }
+  return ret;
+}
+
+void DisposePtr(Ptr p) {
+  memory_manager().free_ptr(p);
+}
+
+Size GetPtrSize(Ptr p) {
+  auto* header = memory_manager().check_ptr_valid(p);
+  return header ? header->size : 0;
 }
 
-void add_destroy_callback(Handle handle, std::function<void()> cb) {
-  memory_manager.add_destroy_callback(handle, cb);
+void add_destroy_callback(Handle handle, DestroyCallback cb, void* context) {
+  memory_manager().add_destroy_callback(handle, cb, context);
 }
 
 void ReplaceHandle(Handle dest, Handle src) {
-  memory_manager.replace_handle(dest, src);
+  memory_manager().replace_handle(dest, src);
 }
 
 void replace_handle_data(Handle handle, const void* data, size_t size) {
-  memory_manager.replace_handle_data(handle, data, size);
+  memory_manager().replace_handle_data(handle, data, size);
 }
 
 Size GetHandleSize(Handle handle) {
-  return memory_manager.get_handle_meta(handle)->size;
+  return memory_manager().get_handle_meta(handle).size;
 }
 
 void SetHandleSize(Handle handle, Size new_size) {
-  memory_manager.resize_handle(handle, new_size);
+  memory_manager().resize_handle(handle, new_size);
+}
+
+SInt8 HGetState(Handle handle) {
+  auto* meta = memory_manager().check_handle_valid(handle);
+  return meta ? static_cast<SInt8>(meta->flags & 0xFF) : 0;
+}
+
+static void set_handle_flag(Handle handle, uint16_t flag, bool set) {
+  auto* meta = memory_manager().check_handle_valid(handle);
+  if (meta) {
+    memory_manager().set_handle_flags(*meta, set ? (meta->flags | flag) : (meta->flags & ~flag), meta->res_type);
+  }
+}
+
+void HSetState(Handle handle, SInt8 flags) {
+  auto* meta = memory_manager().check_handle_valid(handle);
+  if (meta) {
+    memory_manager().set_handle_flags(*meta, (meta->flags & 0xFF00) | static_cast<uint8_t>(flags), meta->res_type);
+  }
+}
+
+void HSetRBit(Handle handle) {
+  set_handle_flag(handle, MemoryManager::HandleMeta::IS_RESOURCE, true);
+}
+
+void HClrRBit(Handle handle) {
+  set_handle_flag(handle, MemoryManager::HandleMeta::IS_RESOURCE, false);
 }
 
 void HPurge(Handle handle) {
-  // We never purge blocks, so we just set memWZErr if the handle is invalid
-  // and otherwise ignore this call
-  memory_manager.check_handle_valid(handle);
+  set_handle_flag(handle, MemoryManager::HandleMeta::PURGEABLE, true);
 }
 
 void HNoPurge(Handle handle) {
-  // We never purge blocks, so we just set memWZErr if the handle is invalid
-  // and otherwise ignore this call
-  memory_manager.check_handle_valid(handle);
+  set_handle_flag(handle, MemoryManager::HandleMeta::PURGEABLE, false);
+}
+
+void EmptyHandle(Handle handle) {
+  auto* meta = memory_manager().check_handle_valid(handle);
+  if (meta) {
+    memory_manager().empty_handle(*meta);
+  }
+}
+
+void touch_handle(Handle handle) {
+  memory_manager().touch_handle(handle);
+}
+
+void set_handle_purge_budget(size_t bytes) {
+  memory_manager().set_purge_budget(bytes);
+}
+
+void purge_handles_over_budget() {
+  memory_manager().purge_to_budget();
+}
+
+Handle new_resource_handle(uint32_t type, const std::string& data) {
+  Handle ret = memory_manager().alloc_handle(data.size(), MemoryManager::HandleMeta::IS_RESOURCE, type);
+  if (ret) {
+    memcpy(*ret, data.data(), data.size());
+  }
+  return ret;
+}
+
+void set_handle_resource_type(Handle handle, uint32_t type) {
+  auto& meta = memory_manager().get_handle_meta(handle);
+  memory_manager().set_handle_flags(meta, meta.flags, type);
+}
+
+void mark_handle_decoded(Handle handle) {
+  set_handle_flag(handle, MemoryManager::HandleMeta::DECODED, true);
+}
+
+void count_decoded_cache_alloc(size_t bytes) {
+  memory_manager().count_decoded_cache_alloc(bytes);
+}
+
+void count_decoded_cache_free(size_t bytes) {
+  memory_manager().count_decoded_cache_free(bytes);
+}
+
+void GetMemStats(int16_t category, MemStats* stats) {
+  *stats = ((category >= 0) && (category < memCategoryCount)) ? memory_manager().sample_category_stats(category) : MemStats{};
+}
+
+void GetResourceMemStats(ResType type, MemStats* stats) {
+  *stats = memory_manager().sample_resource_type_stats(type);
+}
+
+void DumpMemStats(void) {
+  memory_manager().print_stats();
 }
 
 OSErr MemError() {
-  return memory_manager.get_last_error();
+  return memory_manager().get_last_error();
 }
 
 void BlockMove(const void* srcPtr, void* destPtr, Size byteCount) {
@@ -256,9 +1006,16 @@ void BlockMoveData(const void* srcPtr, void* destPtr, Size byteCount) {
   memcpy(destPtr, srcPtr, byteCount);
 }
 
-void HLockHi(Handle h) {}
-void HLock(Handle h) {}
-void HUnlock(Handle h) {}
+// We never move blocks, so locking a handle only keeps it from being purged
+void HLockHi(Handle h) {
+  set_handle_flag(h, MemoryManager::HandleMeta::LOCKED, true);
+}
+void HLock(Handle h) {
+  set_handle_flag(h, MemoryManager::HandleMeta::LOCKED, true);
+}
+void HUnlock(Handle h) {
+  set_handle_flag(h, MemoryManager::HandleMeta::LOCKED, false);
+}
 
 int16_t HiWord(int32_t x) {
   return (int16_t)(x >> 16);
@@ -290,5 +1047,5 @@ int16_t Random(void) {
   do {
     ret = phosg::random_object<int16_t>();
   } while (ret == -0x8000);
-  return ret;
+  return InputLog::instance().on_random(ret);
 }
@@ -18,12 +18,22 @@ void DisposeHandle(Handle handle);
 Size GetHandleSize(Handle h);
 void SetHandleSize(Handle h, Size newSize);
 
+Ptr NewPtr(Size size);
+Ptr NewPtrClear(Size size);
+void DisposePtr(Ptr p);
+Size GetPtrSize(Ptr p);
+
 void HNoPurge(Handle h);
+SInt8 HGetState(Handle h);
+void HSetState(Handle h, SInt8 flags);
+void HSetRBit(Handle h);
+void HClrRBit(Handle h);
 OSErr MemError(void);
 void HPurge(Handle h);
 void HLockHi(Handle h);
 void HLock(Handle h);
 void HUnlock(Handle h);
+void EmptyHandle(Handle h);
 
 ////////////////////////////////////////////////////////////////////////////////
 // Not part of Classic Mac OS API, but convenient for our implementation:
@@ -34,6 +44,45 @@ Handle NewHandleWithData(const void* data, size_t size);
 // not valid (its block was moved into dest).
 void ReplaceHandle(Handle dest, Handle src);
 
+////////////////////////////////////////////////////////////////////////////////
+// Memory statistics (not part of Classic Mac OS API):
+
+enum {
+  memCategoryHandle = 0, // Handles that aren't resources
+  memCategoryResource = 1, // Resource handles containing the resource's data
+  memCategoryDecodedResource = 2, // Resource handles containing decoded data (e.g. after GetPicture)
+  memCategoryPointer = 3, // Nonrelocatable blocks
+  memCategoryDecodedCache = 4, // Caches of decoded data outside the Memory Manager (e.g. QuickDraw's pixel buffers)
+  memCategoryCount = 5,
+};
+
+// Freed blocks are counted by lifetime in these ranges: under 10ms, 100ms,
+// 1s, 10s, 1 minute, 10 minutes, and longer
+#define MEM_LIFETIME_BUCKETS 7
+
+typedef struct {
+  uint32_t liveCount;
+  uint32_t peakCount;
+  uint64_t liveBytes;
+  uint64_t peakBytes;
+  // Totals since startup. allocBytes also includes growth from SetHandleSize.
+  uint64_t allocCount;
+  uint64_t allocBytes;
+  uint64_t freeCount;
+  // Average since the previous time these statistics were retrieved
+  double allocsPerSecond;
+  uint64_t lifetimeCounts[MEM_LIFETIME_BUCKETS];
+} MemStats;
+
+// Handles that become or stop being resources (e.g. with AddResource or
+// DetachResource) move from one category to another, so for those categories,
+// liveCount isn't always allocCount - freeCount.
+void GetMemStats(int16_t category, MemStats* stats);
+// Statistics for resource handles of one type, in both resource categories
+void GetResourceMemStats(ResType type, MemStats* stats);
+// Writes all of the above to the log
+void DumpMemStats(void);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Generic memory functions, which don't actually use the Memory Manager but
 // are somewhat relevant here:
@@ -2,7 +2,6 @@
 
 #include "MemoryManager.h"
 
-#include <functional>
 #include <phosg/Strings.hh>
 #include <string>
 
@@ -38,4 +37,38 @@ void DisposeHandleTyped(ObjT** handle) {
   DisposeHandle(reinterpret_cast<Handle>(handle));
 }
 
-void add_destroy_callback(Handle handle, std::function<void()> cb);
+// Registers a function to be called with context when the handle's data is
+// freed (when it's disposed, emptied, purged, or replaced with ReplaceHandle).
+// Each callback is called only once, then removed. Registering the same
+// callback and context on a handle again does nothing, so callers that rebuild
+// state derived from a handle don't need to track whether they've already
+// registered on it.
+using DestroyCallback = void (*)(void* context);
+void add_destroy_callback(Handle handle, DestroyCallback cb, void* context);
+
+// Unlocked purgeable handles (see HPurge) are emptied, least recently used
+// first, when the game waits for events while the total size of all handles'
+// data is over the purge budget. The budget is 64MB unless REALMZ_HANDLE_BUDGET_MB
+// is set; 0 means handles are never purged. Purging doesn't happen during
+// allocations as it did on Classic Mac OS, since our own code reads resource
+// data across Memory Manager calls.
+void set_handle_purge_budget(size_t bytes);
+void purge_handles_over_budget();
+// Marks a handle as recently used, so other handles are purged before it
+void touch_handle(Handle handle);
+
+// Allocates a handle for a resource's data. This is the same as
+// NewHandleWithData followed by HSetRBit, but the handle is also counted
+// under the resource's type in the memory statistics.
+Handle new_resource_handle(uint32_t type, const std::string& data);
+// Sets the type that a resource handle is counted under in the statistics
+void set_handle_resource_type(Handle handle, uint32_t type);
+// Marks a resource handle as containing data decoded from the resource (like
+// GetPicture does) rather than the resource's own data. This only affects the
+// statistics, and is undone when the handle's data is replaced.
+void mark_handle_decoded(Handle handle);
+// Caches of decoded data that aren't allocated through the Memory Manager
+// call these when they take or release memory, so it's included in the
+// statistics
+void count_decoded_cache_alloc(size_t bytes);
+void count_decoded_cache_free(size_t bytes);
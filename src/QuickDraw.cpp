@@ -22,6 +22,7 @@
 #include <resource_file/TextCodecs.hh>
 #include <stdexcept>
 #include <unordered_map>
+#include <vector>
 
 #include "Font.hpp"
 #include "MemoryManager.hpp"
@@ -47,6 +48,104 @@ struct DecodedPICTHeader {
 static std::unordered_map<int16_t, TTF_Font*> tt_fonts_by_id;
 static std::unordered_map<int16_t, ResourceDASM::BitmapFontRenderer> bm_renderers_by_id;
 
+///////////////////////////////////////////////////////////////////////////////
+// Pixel buffer pool
+
+class PixelBufferPool {
+public:
+  // Upper bound on the memory held by idle buffers, and on the number of idle
+  // buffers kept for any one size
+  static constexpr size_t MAX_POOLED_BYTES = 64 * 1024 * 1024;
+  static constexpr size_t MAX_POOLED_BUFFERS_PER_SIZE = 4;
+
+  // This is intentionally never destroyed, since static ports (e.g. the
+  // default port) release their buffers during static destruction
+  static PixelBufferPool& instance() {
+    static auto* pool = new PixelBufferPool();
+    return *pool;
+  }
+
+  // Returns an image of exactly w x h pixels. If zero is false, the contents
+  // of a recycled buffer are left as they were, which is fine when the caller
+  // is about to overwrite the whole image anyway.
+  phosg::ImageRGBA8888N acquire(size_t w, size_t h, bool zero) {
+    if (w == 0 || h == 0) {
+      return phosg::ImageRGBA8888N();
+    }
+    auto it = this->buffers_by_size.find(this->key_for_size(w, h));
+    if (it == this->buffers_by_size.end() || it->second.empty()) {
+      this->stats.misses++;
+      return phosg::ImageRGBA8888N(w, h);
+    }
+    phosg::ImageRGBA8888N ret = std::move(it->second.back());
+    it->second.pop_back();
+    this->stats.hits++;
+    this->stats.pooled_buffers--;
+    this->stats.pooled_bytes -= this->bytes_for_size(w, h);
+    count_decoded_cache_free(this->bytes_for_size(w, h));
+    if (zero) {
+      ret.write_rect(0, 0, w, h, 0x00000000);
+    }
+    return ret;
+  }
+
+  void release(phosg::ImageRGBA8888N&& img) {
+    size_t w = img.get_width();
+    size_t h = img.get_height();
+    if (w == 0 || h == 0) {
+      return;
+    }
+    size_t bytes = this->bytes_for_size(w, h);
+    auto& bucket = this->buffers_by_size[this->key_for_size(w, h)];
+    if ((bucket.size() >= MAX_POOLED_BUFFERS_PER_SIZE) ||
+        (this->stats.pooled_bytes + bytes > MAX_POOLED_BYTES)) {
+      this->stats.discarded++;
+      return; // img is freed by the caller
+    }
+    bucket.emplace_back(std::move(img));
+    this->stats.recycled++;
+    this->stats.pooled_buffers++;
+    this->stats.pooled_bytes += bytes;
+    count_decoded_cache_alloc(bytes);
+  }
+
+  void trim() {
+    for (const auto& [key, bucket] : this->buffers_by_size) {
+      for (const auto& img : bucket) {
+        count_decoded_cache_free(this->bytes_for_size(img.get_width(), img.get_height()));
+      }
+    }
+    this->buffers_by_size.clear();
+    this->stats.pooled_buffers = 0;
+    this->stats.pooled_bytes = 0;
+  }
+
+  const PixelBufferPoolStats& get_stats() const {
+    return this->stats;
+  }
+
+private:
+  std::unordered_map<uint64_t, std::vector<phosg::ImageRGBA8888N>> buffers_by_size;
+  PixelBufferPoolStats stats;
+
+  PixelBufferPool() = default;
+
+  static uint64_t key_for_size(size_t w, size_t h) {
+    return (static_cast<uint64_t>(w) << 32) | static_cast<uint64_t>(h);
+  }
+  static size_t bytes_for_size(size_t w, size_t h) {
+    return w * h * sizeof(uint32_t);
+  }
+};
+
+PixelBufferPoolStats get_pixel_buffer_pool_stats() {
+  return PixelBufferPool::instance().get_stats();
+}
+
+void trim_pixel_buffer_pool() {
+  PixelBufferPool::instance().trim();
+}
+
 std::unordered_set<const CCGrafPort*> CCGrafPort::all_ports;
 
 CCGrafPort* CCGrafPort::as_port(void* ptr) {
@@ -62,22 +161,7 @@ const CCGrafPort* CCGrafPort::as_port(const void* ptr) {
 CCGrafPort::CCGrafPort()
     : log(std::format("[CCGrafPort:{:016X}] ", reinterpret_cast<intptr_t>(this)), qd_log.min_level),
       is_window(false) {
-  this->portBits = BitMap{};
-  this->portRect = {0, 0, 0, 0};
-  this->txFont = 0;
-  this->txFace = 0;
-  this->txMode = 0;
-  this->txSize = 12;
-  this->pnLoc = {0, 0};
-  this->pnSize = {1, 1};
-  this->pnMode = 0;
-  this->portPixMap = nullptr;
-  this->pnPixPat = nullptr;
-  this->bkPixPat = nullptr;
-  this->fgColor = 0x00000000;
-  this->bgColor = 0xFFFFFFFF;
-  this->rgbFgColor = {0x0000, 0x0000, 0x0000};
-  this->rgbBgColor = {0xFFFF, 0xFFFF, 0xFFFF};
+  this->reset_state();
   all_ports.emplace(this);
   this->log.debug_f("Created");
 }
@@ -85,7 +169,10 @@ CCGrafPort::CCGrafPort()
 CCGrafPort::CCGrafPort(const Rect& bounds, bool is_window) : CCGrafPort() {
   this->portRect = bounds;
   this->is_window = is_window;
-  this->data.resize(this->portRect.right - this->portRect.left, this->portRect.bottom - this->portRect.top);
+  // Window contents are always erased or drawn before they are composited, so
+  // only offscreen ports need a cleared buffer
+  this->data = PixelBufferPool::instance().acquire(
+      this->portRect.right - this->portRect.left, this->portRect.bottom - this->portRect.top, !is_window);
   this->log.debug_f("Resized to {}x{} with origin ({}, {}) and is_window={}",
       this->get_width(), this->get_height(), this->portRect.left, this->portRect.top, is_window ? "true" : "false");
   // We don't have to add this to all_ports here because the default
@@ -95,12 +182,42 @@ CCGrafPort::CCGrafPort(const Rect& bounds, bool is_window) : CCGrafPort() {
 CCGrafPort::~CCGrafPort() {
   this->log.debug_f("Destroyed");
   all_ports.erase(this);
+  PixelBufferPool::instance().release(std::move(this->data));
+}
+
+void CCGrafPort::reset_state() {
+  this->portBits = BitMap{};
+  this->portRect = {0, 0, 0, 0};
+  this->txFont = 0;
+  this->txFace = 0;
+  this->txMode = 0;
+  this->txSize = 12;
+  this->pnLoc = {0, 0};
+  this->pnSize = {1, 1};
+  this->pnMode = 0;
+  this->portPixMap = nullptr;
+  this->pnPixPat = nullptr;
+  this->bkPixPat = nullptr;
+  this->fgColor = 0x00000000;
+  this->bgColor = 0xFFFFFFFF;
+  this->rgbFgColor = {0x0000, 0x0000, 0x0000};
+  this->rgbBgColor = {0xFFFF, 0xFFFF, 0xFFFF};
 }
 
 void CCGrafPort::resize(size_t w, size_t h) {
   this->portRect.right = this->portRect.left + w;
   this->portRect.bottom = this->portRect.top + h;
-  this->data.resize(w, h);
+  if (w != this->data.get_width() || h != this->data.get_height()) {
+    // Keep the overlapping part of the old contents, as resizing in place would
+    auto new_data = PixelBufferPool::instance().acquire(w, h, true);
+    size_t copy_w = std::min<size_t>(w, this->data.get_width());
+    size_t copy_h = std::min<size_t>(h, this->data.get_height());
+    if (copy_w && copy_h) {
+      new_data.copy_from(this->data, 0, 0, copy_w, copy_h, 0, 0);
+    }
+    PixelBufferPool::instance().release(std::move(this->data));
+    this->data = std::move(new_data);
+  }
   this->log.debug_f("Resized to {}x{}", this->get_width(), this->get_height());
 }
 
@@ -142,8 +259,64 @@ void CCGrafPort::draw_rgba8888_data(const void* pixels, int sw, int sh, const Re
   this->data.copy_from_with_blend(src, rect.left, rect.top, dw, dh, 0, 0, sw, sh, phosg::ResizeMode::NEAREST_NEIGHBOR);
 }
 
+static bool is_decoded_pict(Handle data_handle) {
+  auto r = read_from_handle(data_handle);
+  const auto& header = r.get<DecodedPICTHeader>();
+  return (header.version_opcode == 0x0011 && header.version_arg == 0x03FF && header.data_opcode == 0xFFFF);
+}
+
+// Replaces the raw bytes of a PICT resource in data_handle with the decoded
+// image, unless that was already done. To indicate that the handle contains
+// decoded data, we prepend a header claiming that it's PICT version 3 (there
+// were only PICT versions 1 and 2 used in QuickDraw).
+static void decode_pict_resource_in_place(Handle data_handle) {
+  if (is_decoded_pict(data_handle)) {
+    return;
+  }
+
+  auto p = ResourceDASM::ResourceFile::decode_PICT_only(*data_handle, GetHandleSize(data_handle));
+  if (p.image.get_height() == 0 || p.image.get_width() == 0) {
+    int16_t id = 0;
+    ResType type;
+    Str255 name;
+    GetResInfo(data_handle, &id, &type, name);
+    throw std::runtime_error(std::format("Failed to decode PICT {}", id));
+  }
+
+  // Generate the decoded PICT data stream
+  DecodedPICTHeader header;
+  header.size = 0; // This is common for Picture objects; it's ignored by QD
+  header.bounds.left = 0;
+  header.bounds.top = 0;
+  header.bounds.right = p.image.get_width();
+  header.bounds.bottom = p.image.get_height();
+  header.version_opcode = 0x0011;
+  header.version_arg = 0x03FF;
+  header.data_opcode = 0xFFFF;
+
+  phosg::StringWriter w;
+  w.put<DecodedPICTHeader>(header);
+  w.write(p.image.get_data(), p.image.get_data_size());
+
+  // Now, free the original data handle buffer with the raw bytes, and change the data_handle
+  // to contain the new pointer to the decoded image.
+  replace_handle_data(data_handle, w.str().data(), w.str().size());
+  mark_handle_decoded(data_handle);
+}
+
 void CCGrafPort::draw_decoded_pict_from_handle(PicHandle pict, const Rect& rect) {
-  // See GetPicture for a description of what's going on here.
+  // See GetPicture for a description of what's going on here. If the picture
+  // was purged since then, the Resource Manager reloads its raw bytes, so it
+  // has to be decoded again. If it can't be reloaded (for example, it was
+  // detached from its resource file), there's nothing to draw.
+  if (!*pict) {
+    LoadResource(reinterpret_cast<Handle>(pict));
+    if (ResError() != noErr || !*pict) {
+      qd_log.warning_f("Cannot draw purged picture {:p}: it could not be reloaded", static_cast<void*>(pict));
+      return;
+    }
+    decode_pict_resource_in_place(reinterpret_cast<Handle>(pict));
+  }
   auto r = read_from_handle(reinterpret_cast<Handle>(pict));
   const auto& header = r.get<DecodedPICTHeader>();
   if (header.version_opcode != 0x0011 || header.version_arg != 0x03FF || header.data_opcode != 0xFFFF) {
@@ -203,7 +376,10 @@ bool CCGrafPort::draw_text_bitmap(const ResourceDASM::BitmapFontRenderer& render
 }
 
 bool CCGrafPort::draw_text(const std::string& text, const Rect& r) {
-  std::string processed_text = replace_param_text(text);
+  return this->draw_processed_text(replace_param_text(text), r);
+}
+
+bool CCGrafPort::draw_processed_text(const std::string& processed_text, const Rect& r) {
   if (processed_text.empty()) {
     return true;
   }
@@ -227,7 +403,7 @@ bool CCGrafPort::draw_text(const std::string& text, const Rect& r) {
   }
 
   if (!success) {
-    this->log.error_f("No renderer is available for font {}; cannot render text \"{}\"", this->txFont, text);
+    this->log.error_f("No renderer is available for font {}; cannot render text \"{}\"", this->txFont, processed_text);
   }
   return success;
 }
@@ -697,46 +873,13 @@ PicHandle GetPicture(int16_t id) {
   // Otherwise, subsequent calls to DetachResource or ReleaseResource would fail to find it.
   //
   // By default, the GetResource call leaves the raw bytes of the resource in data_handle. To
-  // satisfy the above, we replace that with the fully decoded Picture resource. To indicate that
-  // the handle contains decoded data, we prepend a header claiming that it's PICT version 3
-  // (there were only PICT versions 1 and 2 used in QuickDraw).
+  // satisfy the above, we replace that with the fully decoded Picture resource (see
+  // decode_pict_resource_in_place).
   auto data_handle = GetResource(ResourceDASM::RESOURCE_TYPE_PICT, id);
   if (!data_handle) {
     return nullptr;
   }
-
-  {
-    auto r = read_from_handle(data_handle);
-    const auto& header = r.get<DecodedPICTHeader>();
-    if (header.version_opcode == 0x0011 && header.version_arg == 0x03FF && header.data_opcode == 0xFFFF) {
-      return reinterpret_cast<PicHandle>(data_handle);
-    }
-  }
-
-  auto p = ResourceDASM::ResourceFile::decode_PICT_only(*data_handle, GetHandleSize(data_handle));
-  if (p.image.get_height() == 0 || p.image.get_width() == 0) {
-    throw std::runtime_error(std::format("Failed to decode PICT {}", id));
-  }
-
-  // Generate the decoded PICT data stream
-  DecodedPICTHeader header;
-  header.size = 0; // This is common for Picture objects; it's ignored by QD
-  header.bounds.left = 0;
-  header.bounds.top = 0;
-  header.bounds.right = p.image.get_width();
-  header.bounds.bottom = p.image.get_height();
-  header.version_opcode = 0x0011;
-  header.version_arg = 0x03FF;
-  header.data_opcode = 0xFFFF;
-
-  phosg::StringWriter w;
-  w.put<DecodedPICTHeader>(header);
-  w.write(p.image.get_data(), p.image.get_data_size());
-
-  // Now, free the original data handle buffer with the raw bytes, and change the data_handle
-  // to contain the new pointer to the decoded image.
-  replace_handle_data(data_handle, w.str().data(), w.str().size());
-
+  decode_pict_resource_in_place(data_handle);
   return reinterpret_cast<PicHandle>(data_handle);
 }
 
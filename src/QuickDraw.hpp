@@ -55,6 +55,9 @@ public:
     return this->data.get_height();
   }
 
+  // Resets all drawing state (pen, text, colors, patterns and portRect) to the
+  // values a new port has. Does not affect the pixel data.
+  void reset_state();
   void resize(size_t w, size_t h);
 
   void erase_rect(const Rect& rect);
@@ -64,6 +67,9 @@ public:
   void draw_rgba8888_data(const void* pixels, int w, int h, const Rect& rect);
   void draw_decoded_pict_from_handle(PicHandle pict, const Rect& rect);
   bool draw_text(const std::string& text, const Rect& dispRect);
+  // Same as above, but the text must already have had ParamText substitution
+  // applied (e.g. via ParamTextCache)
+  bool draw_processed_text(const std::string& processed_text, const Rect& dispRect);
   // Draws the specified text when the display bounds are unknown. Updates the port's pen location
   // after the draw to be immediately to the right of the drawn text.
   void draw_text(const std::string& text);
@@ -88,6 +94,22 @@ protected:
 
 CCGrafPort& get_default_port();
 
+// Pixel buffers for ports are recycled through a pool keyed by dimensions,
+// since the game creates and disposes same-sized GWorlds and dialogs over and
+// over. These counters describe how well that is working.
+struct PixelBufferPoolStats {
+  size_t hits = 0; // Acquisitions satisfied from the pool
+  size_t misses = 0; // Acquisitions that had to allocate a new buffer
+  size_t recycled = 0; // Released buffers kept for reuse
+  size_t discarded = 0; // Released buffers freed because the pool was full
+  size_t pooled_buffers = 0; // Buffers currently held by the pool
+  size_t pooled_bytes = 0; // Pixel bytes currently held by the pool
+};
+PixelBufferPoolStats get_pixel_buffer_pool_stats();
+// Frees all buffers held by the pool. Buffers owned by live ports are not
+// affected.
+void trim_pixel_buffer_pool();
+
 Rect rect_from_reader(phosg::StringReader& data);
 
 inline uint32_t rgba8888_for_rgb_color(const RGBColor& color) {
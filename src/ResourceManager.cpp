@@ -34,6 +34,16 @@ public:
     // into source_res when the file is saved.
     bool data_modified;
 
+    // Reloads the data from source_res if the handle was purged, and
+    // otherwise just marks the handle as recently used
+    void load() {
+      if (*this->data_handle) {
+        touch_handle(this->data_handle);
+      } else {
+        replace_handle_data(this->data_handle, this->source_res->data.data(), this->source_res->data.size());
+      }
+    }
+
     ~Resource() {
       if (this->data_handle) {
         DisposeHandle(this->data_handle);
@@ -63,6 +73,7 @@ public:
       uint64_t key = this->key_for_type_id(type, id);
       auto loaded_res = this->resource_for_type_id.find(key);
       if (loaded_res != this->resource_for_type_id.end()) {
+        loaded_res->second->load();
         return loaded_res->second;
       }
       std::shared_ptr<const ResourceDASM::ResourceFile::Resource> source_res;
@@ -74,7 +85,13 @@ public:
       auto res = std::make_shared<Resource>();
       res->file_refnum = this->refnum;
       res->source_res = source_res;
-      res->data_handle = NewHandleWithData(res->source_res->data);
+      res->data_handle = new_resource_handle(type, res->source_res->data);
+      if (res->source_res->flags & resLocked) {
+        HLock(res->data_handle);
+      }
+      if (res->source_res->flags & resPurgeable) {
+        HPurge(res->data_handle);
+      }
       res->data_modified = false;
       this->resource_for_type_id.emplace(key, res);
       this->resource_for_handle.emplace(res->data_handle, res);
@@ -101,6 +118,9 @@ public:
           throw std::logic_error("Tried to mark unknown data handle as modified");
         }
         res->data_modified = true;
+        // The changes would be lost if the handle were purged before the file
+        // is written
+        HNoPurge(data_handle);
       }
       this->state = ResourceManager::File::State::MODIFIED;
     }
@@ -127,6 +147,8 @@ public:
       res->source_res = rf_res;
       res->data_handle = data_handle;
       res->data_modified = false;
+      HSetRBit(data_handle);
+      set_handle_resource_type(data_handle, type);
       if (!this->resource_for_type_id.emplace(this->key_for_type_id(type, id), res).second) {
         throw std::logic_error(std::format(
             "Added resource {:08X}:{} but it already exists in the ResourceFile", type, id));
@@ -146,6 +168,7 @@ public:
       // doesn't want to keep the data in memory.
       this->resource_for_type_id.erase(this->key_for_type_id(res->source_res->type, res->source_res->id));
       this->resource_for_handle.erase(res->data_handle);
+      HClrRBit(res->data_handle);
       res->data_handle = nullptr; // Prevent destructor from freeing the handle
 
       // Delete the backing object in ResourceFile
@@ -163,6 +186,10 @@ public:
       this->resource_for_type_id.erase(this->key_for_type_id(res->source_res->type, res->source_res->id));
       this->resource_for_handle.erase(res->data_handle);
       if (!free_data) {
+        // The handle no longer belongs to a resource, so it couldn't be
+        // reloaded if it were purged
+        HNoPurge(res->data_handle);
+        HClrRBit(res->data_handle);
         res->data_handle = nullptr; // Prevent destructor from freeing the handle
       }
     }
@@ -581,6 +608,15 @@ Handle Get1Resource(ResType type, int16_t id) {
   return nullptr;
 }
 
+void LoadResource(Handle data_handle) {
+  try {
+    rm.get_resource(data_handle)->load();
+    resError = noErr;
+  } catch (const std::out_of_range&) {
+    resError = resNotFound;
+  }
+}
+
 int32_t GetResourceSizeOnDisk(Handle data_handle) {
   auto res = rm.get_resource(data_handle);
   if (res != nullptr) {
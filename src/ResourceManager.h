@@ -17,6 +17,12 @@ enum {
   addResFailed = -194,
 };
 
+// Resource attributes (as returned by GetResAttrs)
+enum {
+  resLocked = 0x10,
+  resPurgeable = 0x20,
+};
+
 void FSpCreateResFile(const FSSpec* spec, OSType creator, OSType fileType, ScriptCode scriptTag);
 int16_t FSpOpenResFile(const FSSpec* spec, SInt8 permission);
 void CloseResFile(int16_t refNum);
@@ -32,6 +38,7 @@ int16_t GetResAttrs(Handle theResource);
 void SetResAttrs(Handle theResource, int16_t attrs);
 Handle GetResource(ResType theType, int16_t theID);
 Handle Get1Resource(ResType theType, int16_t theID);
+void LoadResource(Handle theResource);
 int32_t GetResourceSizeOnDisk(Handle theResource);
 void AddResource(Handle theData, ResType theType, int16_t theID, ConstStr255Param name);
 void ChangedResource(Handle theResource);
@@ -0,0 +1,262 @@
+#include "TextEdit.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+///////////////////////////////////////////////////////////////////////////////
+// TextGapBuffer
+
+TextGapBuffer::TextGapBuffer(const std::string& text) {
+  this->assign(text.data(), text.size());
+}
+
+void TextGapBuffer::assign(const char* text, size_t size) {
+  this->data.assign(text, text + size);
+  this->gap_start = size;
+  this->gap_end = size;
+}
+
+void TextGapBuffer::clear() {
+  this->data.clear();
+  this->gap_start = 0;
+  this->gap_end = 0;
+}
+
+void TextGapBuffer::move_gap(size_t pos) {
+  size_t gap_size = this->gap_end - this->gap_start;
+  if (pos < this->gap_start) {
+    // Move the bytes in [pos, gap_start) to the end of the gap
+    size_t count = this->gap_start - pos;
+    memmove(&this->data[this->gap_end - count], &this->data[pos], count);
+  } else if (pos > this->gap_start) {
+    // Move the bytes in [gap_end, pos + gap_size) to the start of the gap
+    size_t count = pos - this->gap_start;
+    memmove(&this->data[this->gap_start], &this->data[this->gap_end], count);
+  }
+  this->gap_start = pos;
+  this->gap_end = pos + gap_size;
+}
+
+void TextGapBuffer::reserve_gap(size_t size) {
+  size_t gap_size = this->gap_end - this->gap_start;
+  if (gap_size >= size) {
+    return;
+  }
+  // Grow geometrically so that a series of small inserts is amortized O(1)
+  size_t new_gap_size = std::max<size_t>(std::max<size_t>(size, this->data.size() / 2), 64);
+  size_t after_gap = this->data.size() - this->gap_end;
+  this->data.resize(this->gap_start + new_gap_size + after_gap);
+  if (after_gap) {
+    memmove(&this->data[this->gap_start + new_gap_size], &this->data[this->gap_end], after_gap);
+  }
+  this->gap_end = this->gap_start + new_gap_size;
+}
+
+void TextGapBuffer::insert(size_t pos, const char* text, size_t size) {
+  if (pos > this->size()) {
+    throw std::out_of_range("Insert position is beyond end of text");
+  }
+  if (size == 0) {
+    return;
+  }
+  this->move_gap(pos);
+  this->reserve_gap(size);
+  memcpy(&this->data[this->gap_start], text, size);
+  this->gap_start += size;
+}
+
+void TextGapBuffer::erase(size_t pos, size_t size) {
+  if (pos + size > this->size()) {
+    throw std::out_of_range("Erased range is beyond end of text");
+  }
+  this->move_gap(pos);
+  this->gap_end += size;
+}
+
+std::string TextGapBuffer::substr(size_t pos, size_t size) const {
+  if (pos + size > this->size()) {
+    throw std::out_of_range("Substring is beyond end of text");
+  }
+  std::string ret;
+  ret.reserve(size);
+  size_t end = pos + size;
+  if (pos < this->gap_start) {
+    size_t before_end = std::min(end, this->gap_start);
+    ret.append(&this->data[pos], before_end - pos);
+  }
+  if (end > this->gap_start) {
+    size_t gap_size = this->gap_end - this->gap_start;
+    size_t after_start = std::max(pos, this->gap_start);
+    ret.append(&this->data[after_start + gap_size], end - after_start);
+  }
+  return ret;
+}
+
+std::string TextGapBuffer::str() const {
+  return this->substr(0, this->size());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TextLineLayout
+
+size_t TextLineLayout::wrap_line(const TextGapBuffer& text, size_t start, size_t max_width, const MeasureFn& measure) {
+  size_t size = text.size();
+  size_t para_end = start;
+  while (para_end < size && text.at(para_end) != '\n') {
+    para_end++;
+  }
+
+  // Take as many whole words as fit. Each word includes the spaces before it,
+  // so spaces at the end of a line don't count toward its width. Each word is
+  // measured once and the widths are summed, rather than re-measuring the
+  // line from its start for every word. (This ignores kerning across word
+  // boundaries, which can be off by a pixel or so with TrueType fonts.)
+  size_t fit_end = start;
+  size_t width = 0;
+  while (fit_end < para_end) {
+    size_t word_end = fit_end;
+    while (word_end < para_end && text.at(word_end) == ' ') {
+      word_end++;
+    }
+    while (word_end < para_end && text.at(word_end) != ' ') {
+      word_end++;
+    }
+    size_t word_width = measure(text.substr(fit_end, word_end - fit_end));
+    if (width + word_width > max_width) {
+      break;
+    }
+    width += word_width;
+    fit_end = word_end;
+  }
+
+  if (fit_end == para_end) {
+    // The rest of the paragraph fits; the next line starts after the newline
+    return (para_end < size) ? (para_end + 1) : size;
+  }
+
+  if (fit_end == start) {
+    // Not even the first word fits, so break it at the last character that
+    // does (but always take at least one character, so we make progress)
+    size_t end = start + 1;
+    size_t char_width = measure(text.substr(start, 1));
+    while (end < para_end) {
+      char_width += measure(text.substr(end, 1));
+      if (char_width > max_width) {
+        break;
+      }
+      end++;
+    }
+    return end;
+  }
+
+  // Break at the spaces after the last word that fits
+  size_t next = fit_end;
+  while (next < para_end && text.at(next) == ' ') {
+    next++;
+  }
+  return (next == para_end && para_end < size) ? (next + 1) : next;
+}
+
+void TextLineLayout::reflow_all(const TextGapBuffer& text, size_t max_width, const MeasureFn& measure) {
+  this->line_starts.clear();
+  this->line_starts.emplace_back(0);
+  size_t size = text.size();
+  size_t start = 0;
+  while (start < size) {
+    size_t next = wrap_line(text, start, max_width, measure);
+    if (next == size && text.at(size - 1) != '\n') {
+      break;
+    }
+    this->line_starts.emplace_back(next);
+    start = next;
+  }
+}
+
+TextLineLayout::ChangedRange TextLineLayout::reflow_after_edit(
+    const TextGapBuffer& text,
+    size_t pos,
+    size_t removed_size,
+    size_t inserted_size,
+    size_t max_width,
+    const MeasureFn& measure) {
+  std::vector<size_t> old_starts = std::move(this->line_starts);
+  int64_t delta = static_cast<int64_t>(inserted_size) - static_cast<int64_t>(removed_size);
+  size_t edit_end = pos + inserted_size;
+
+  // Removing text from the first word of a line can make that word fit on the
+  // previous line, so re-flowing has to start one line before the edit. If
+  // the edit is in a word too long for one line, it was broken across several
+  // lines, and the word's first line is the one that matters, so back up past
+  // lines that start mid-word first. (Text before pos hasn't changed, so it
+  // still shows where the old breaks were.)
+  size_t first_line = std::upper_bound(old_starts.begin(), old_starts.end(), pos) - old_starts.begin() - 1;
+  while (first_line > 0 && text.at(old_starts[first_line] - 1) != ' ' && text.at(old_starts[first_line] - 1) != '\n') {
+    first_line--;
+  }
+  if (first_line > 0) {
+    first_line--;
+  }
+  this->line_starts.assign(old_starts.begin(), old_starts.begin() + first_line + 1);
+
+  // Old line starts after the edited range are candidates for resynchronizing
+  // with the old layout: once a new line starts at the same (shifted) offset
+  // as an old line, everything after it wraps the same way as before
+  size_t old_index = std::upper_bound(old_starts.begin(), old_starts.end(), pos + removed_size) - old_starts.begin();
+
+  ChangedRange ret;
+  ret.first_line = first_line;
+  size_t size = text.size();
+  size_t start = this->line_starts.back();
+  bool resynced = false;
+  while (start < size) {
+    size_t next = wrap_line(text, start, max_width, measure);
+    if (next == size && text.at(size - 1) != '\n') {
+      break;
+    }
+
+    if (next >= edit_end) {
+      while (old_index < old_starts.size() && static_cast<int64_t>(old_starts[old_index]) + delta < static_cast<int64_t>(next)) {
+        old_index++;
+      }
+      if (old_index < old_starts.size() && static_cast<int64_t>(old_starts[old_index]) + delta == static_cast<int64_t>(next)) {
+        ret.end_line = this->line_starts.size();
+        for (size_t z = old_index; z < old_starts.size(); z++) {
+          this->line_starts.emplace_back(old_starts[z] + delta);
+        }
+        resynced = true;
+        break;
+      }
+    }
+
+    this->line_starts.emplace_back(next);
+    start = next;
+  }
+
+  if (!resynced) {
+    ret.end_line = this->line_starts.size();
+  }
+  ret.line_count_changed = (this->line_starts.size() != old_starts.size());
+  return ret;
+}
+
+size_t TextLineLayout::line_end(const TextGapBuffer& text, size_t line) const {
+  size_t start = this->line_starts.at(line);
+  size_t end = (line + 1 < this->line_starts.size()) ? this->line_starts[line + 1] : text.size();
+  if (end > start && text.at(end - 1) == '\n') {
+    end--;
+  }
+  while (end > start && text.at(end - 1) == ' ') {
+    end--;
+  }
+  return end;
+}
+
+std::string TextLineLayout::line_text(const TextGapBuffer& text, size_t line) const {
+  size_t start = this->line_starts.at(line);
+  return text.substr(start, this->line_end(text, line) - start);
+}
+
+size_t TextLineLayout::line_for_offset(size_t offset) const {
+  return std::upper_bound(this->line_starts.begin(), this->line_starts.end(), offset) - this->line_starts.begin() - 1;
+}
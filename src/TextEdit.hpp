@@ -0,0 +1,98 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Text storage for TextEdit records. Insertions and deletions near the
+// previous edit only move the bytes between the two positions, so typing or
+// appending to a long text doesn't copy the whole thing each time.
+class TextGapBuffer {
+public:
+  TextGapBuffer() = default;
+  explicit TextGapBuffer(const std::string& text);
+
+  inline size_t size() const {
+    return this->data.size() - (this->gap_end - this->gap_start);
+  }
+  inline bool empty() const {
+    return this->size() == 0;
+  }
+  inline char at(size_t pos) const {
+    return (pos < this->gap_start) ? this->data[pos] : this->data[pos + (this->gap_end - this->gap_start)];
+  }
+
+  void assign(const char* text, size_t size);
+  void insert(size_t pos, const char* text, size_t size);
+  void erase(size_t pos, size_t size);
+  void clear();
+
+  std::string substr(size_t pos, size_t size) const;
+  std::string str() const;
+
+private:
+  std::vector<char> data;
+  size_t gap_start = 0;
+  size_t gap_end = 0;
+
+  void move_gap(size_t pos);
+  void reserve_gap(size_t size);
+};
+
+// Line-break table for a TextGapBuffer wrapped to a fixed pixel width. After
+// an edit, lines are re-flowed starting at the line before the edit, and
+// re-flowing stops as soon as a line break lines up with one from the
+// previous layout, so edits near the beginning of a long text don't re-wrap
+// everything after them.
+class TextLineLayout {
+public:
+  // Returns the pixel width of the given text when drawn on a single line
+  using MeasureFn = std::function<size_t(const std::string&)>;
+
+  // Describes which lines changed in a reflow. Lines in [first_line,
+  // end_line) of the new layout have different text than before; lines after
+  // that have the same text, but if line_count_changed is true, they've moved
+  // to a different index.
+  struct ChangedRange {
+    size_t first_line = 0;
+    size_t end_line = 0;
+    bool line_count_changed = false;
+  };
+
+  TextLineLayout() = default;
+
+  // Wraps the entire text from scratch
+  void reflow_all(const TextGapBuffer& text, size_t max_width, const MeasureFn& measure);
+  // Updates the layout after removed_size bytes at offset pos were replaced
+  // with inserted_size bytes. text must already contain the change.
+  ChangedRange reflow_after_edit(
+      const TextGapBuffer& text,
+      size_t pos,
+      size_t removed_size,
+      size_t inserted_size,
+      size_t max_width,
+      const MeasureFn& measure);
+
+  inline size_t num_lines() const {
+    return this->line_starts.size();
+  }
+  inline size_t line_start(size_t line) const {
+    return this->line_starts.at(line);
+  }
+  // Returns the end of the line's text, excluding the newline or the spaces
+  // at which the line was wrapped. text must be the text that was laid out.
+  size_t line_end(const TextGapBuffer& text, size_t line) const;
+  std::string line_text(const TextGapBuffer& text, size_t line) const;
+  size_t line_for_offset(size_t offset) const;
+
+private:
+  // line_starts[0] is always 0, and there is always at least one line (which
+  // may be empty)
+  std::vector<size_t> line_starts{0};
+
+  // Returns the offset at which the next line begins after the line that
+  // begins at start. Returns text.size() if the line runs to the end of the
+  // text, which may also be the start of an empty last line if the text ends
+  // with a newline.
+  static size_t wrap_line(const TextGapBuffer& text, size_t start, size_t max_width, const MeasureFn& measure);
+};
@@ -69,6 +69,13 @@ typedef struct {
   UInt32 lowLongOfPSN;
 } ProcessSerialNumber;
 
+typedef struct {
+  UInt32 hi;
+  UInt32 lo;
+} UnsignedWide;
+typedef UnsignedWide AbsoluteTime;
+typedef UnsignedWide Nanoseconds;
+
 #pragma pack(pop)
 
 #ifdef __cplusplus
@@ -2,7 +2,9 @@
 
 #include <SDL3/SDL_keyboard.h>
 #include <SDL3/SDL_properties.h>
+#include <cstdlib>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 
 #include <SDL3/SDL.h>
@@ -18,12 +20,15 @@
 #include <resource_file/ResourceFile.hh>
 
 #include "EventManager.h"
+#include "EventManager.hpp"
 #include "Font.hpp"
 #include "MemoryManager.h"
+#include "MemoryManager.hpp"
 #include "QuickDraw.h"
 #include "QuickDraw.hpp"
 #include "ResourceManager.h"
 #include "StringConvert.hpp"
+#include "TextEdit.hpp"
 #include "Types.hpp"
 
 using ResourceDASM::ResourceFile;
@@ -31,6 +36,14 @@ using ResourceDASM::ResourceFile;
 // Enable these to save an image named debug*.bmp every time the main window or dialog items are recomposited
 static constexpr bool ENABLE_RECOMPOSITE_DEBUG = false;
 static constexpr bool ENABLE_DIALOG_RECOMPOSITE_DEBUG = false;
+// Disable this to re-render every dialog item on every DrawDialog call, instead of only the items that changed
+static constexpr bool ENABLE_RETAINED_DIALOG_RENDERING = true;
+// Maximum number of disposed dialogs to keep for reuse
+static constexpr size_t MAX_PARKED_WINDOWS = 8;
+// Cell size for the dialog item hit-test grid. The cell size is doubled as
+// needed to keep the grid within the maximum cell count.
+static constexpr int16_t HIT_GRID_CELL_SIZE = 32;
+static constexpr size_t MAX_HIT_GRID_CELLS = 1024;
 bool enable_translucent_window_debug = false;
 static size_t debug_number = 1;
 
@@ -47,6 +60,10 @@ inline Rect copy_rect(const ResourceDASM::Rect& src) {
   return Rect{.top = src.y1.load(), .left = src.x1.load(), .bottom = src.y2.load(), .right = src.x2.load()};
 }
 
+inline bool rects_overlap(const Rect& a, const Rect& b) {
+  return (a.left < b.right) && (b.left < a.right) && (a.top < b.bottom) && (b.top < a.bottom);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -54,10 +71,246 @@ inline Rect copy_rect(const ResourceDASM::Rect& src) {
 
 static phosg::PrefixedLogger wm_log("[WindowManager] ", DEFAULT_LOG_LEVEL);
 
-static size_t generate_opaque_handle() {
-  static size_t next_handle = 1;
-  return next_handle++;
-}
+struct DialogItem;
+
+// Dialog items (and therefore controls and unstyled TextEdit records) are
+// referred to from C code by opaque handles. A handle encodes an index into
+// this table's slot vector and the generation of that slot, so looking up an
+// item is a bounds check and an array access, and a handle to an item that has
+// since been destroyed is detected because its slot's generation has moved
+// on. The tag in the high bits makes these handles non-canonical addresses, so
+// they can never be confused with StyledTextEdit pointers.
+class DialogItemHandleTable {
+public:
+  DialogItemHandleTable() = default;
+  ~DialogItemHandleTable() = default;
+
+  // Reserves a slot and returns its handle. The slot doesn't refer to an item
+  // until set() is called.
+  size_t allocate() {
+    uint32_t index;
+    if (this->first_free_index != NO_FREE_INDEX) {
+      index = this->first_free_index;
+      this->first_free_index = this->slots[index].next_free_index;
+    } else {
+      if (this->slots.size() >= HANDLE_INDEX_MASK) {
+        throw std::runtime_error("Too many dialog items");
+      }
+      index = this->slots.size();
+      this->slots.emplace_back();
+    }
+    auto& slot = this->slots[index];
+    slot.in_use = true;
+    slot.next_free_index = NO_FREE_INDEX;
+    return make_handle(index, slot.generation);
+  }
+
+  void set(size_t handle, std::weak_ptr<DialogItem> item) {
+    this->slot_for_handle(handle).item = std::move(item);
+  }
+
+  // This is called from DialogItem's destructor, so it must not throw. A
+  // handle that doesn't refer to a live slot is ignored.
+  void release(size_t handle) noexcept {
+    uint32_t index = index_for_handle(handle);
+    if (((handle & HANDLE_TAG_MASK) != HANDLE_TAG) || (index >= this->slots.size()) ||
+        !this->slots[index].in_use || (this->slots[index].generation != generation_for_handle(handle))) {
+      wm_log.warning_f("Ignoring release of stale dialog item handle {:016X}", handle);
+      return;
+    }
+    auto& slot = this->slots[index];
+    slot.item.reset();
+    slot.in_use = false;
+    // Generation 0 is never used, so a zeroed handle can never be valid
+    slot.generation = (slot.generation == 0xFFFF) ? 1 : (slot.generation + 1);
+    slot.next_free_index = this->first_free_index;
+    this->first_free_index = index;
+  }
+
+  // Returns null if the handle refers to a slot that has been released or
+  // reused, or if the item it refers to has been destroyed. Throws
+  // std::out_of_range if the handle was never issued by this table.
+  std::shared_ptr<DialogItem> get(size_t handle) const {
+    if ((handle & HANDLE_TAG_MASK) != HANDLE_TAG) {
+      throw std::out_of_range(std::format("{:016X} is not a dialog item handle", handle));
+    }
+    uint32_t index = index_for_handle(handle);
+    if (index >= this->slots.size()) {
+      throw std::out_of_range(std::format("Dialog item handle {:016X} is out of range", handle));
+    }
+    const auto& slot = this->slots[index];
+    if (!slot.in_use || (slot.generation != generation_for_handle(handle))) {
+      return nullptr;
+    }
+    return slot.item.lock();
+  }
+
+private:
+  static constexpr size_t HANDLE_TAG = 0xD17E000000000000;
+  static constexpr size_t HANDLE_TAG_MASK = 0xFFFF000000000000;
+  static constexpr size_t HANDLE_INDEX_MASK = 0x00000000FFFFFFFF;
+  static constexpr uint32_t NO_FREE_INDEX = 0xFFFFFFFF;
+  static_assert(sizeof(size_t) == 8, "Dialog item handles require 64-bit pointers");
+
+  struct Slot {
+    std::weak_ptr<DialogItem> item;
+    uint32_t next_free_index = NO_FREE_INDEX;
+    uint16_t generation = 1;
+    bool in_use = false;
+  };
+  std::vector<Slot> slots;
+  uint32_t first_free_index = NO_FREE_INDEX;
+
+  static inline size_t make_handle(uint32_t index, uint16_t generation) {
+    return HANDLE_TAG | (static_cast<size_t>(generation) << 32) | index;
+  }
+  static inline uint32_t index_for_handle(size_t handle) {
+    return handle & HANDLE_INDEX_MASK;
+  }
+  static inline uint16_t generation_for_handle(size_t handle) {
+    return (handle >> 32) & 0xFFFF;
+  }
+
+  Slot& slot_for_handle(size_t handle) {
+    auto& slot = this->slots.at(index_for_handle(handle));
+    if (!slot.in_use || (slot.generation != generation_for_handle(handle))) {
+      throw std::logic_error(std::format("Dialog item handle {:016X} is stale", handle));
+    }
+    return slot;
+  }
+};
+
+// Decoded DLOG/WIND, DITL, dctb/wctb and CNTL resources, so that opening the
+// same window or creating the same control repeatedly doesn't re-decode its
+// resources every time. Entries are keyed by the data handle of the DLOG, WIND
+// or CNTL resource, so a resource shadowed by a newly-opened resource file gets
+// its own entry. Each entry is dropped when any of the handles it was built
+// from is disposed (for example, when its resource file is closed).
+class ResourceTemplateCache {
+public:
+  struct WindowTemplate {
+    Rect bounds;
+    int16_t proc_id;
+    std::string title;
+    bool visible;
+    bool go_away;
+    uint32_t ref_con;
+    RGBColor background_color;
+    int16_t ditl_resource_id; // Only used for dialogs
+    std::vector<ResourceFile::DecodedDialogItem> item_defs; // Only used for dialogs
+  };
+
+  struct ControlTemplate {
+    Rect bounds;
+    int16_t value;
+    int16_t min;
+    int16_t max;
+    int16_t proc_id;
+    bool visible;
+    std::string title;
+  };
+
+  // This is intentionally never destroyed, since resource handles can be
+  // disposed (and call the cache's destroy callbacks) during static
+  // destruction
+  static ResourceTemplateCache& instance() {
+    static auto* cache = new ResourceTemplateCache();
+    return *cache;
+  }
+
+  std::shared_ptr<const WindowTemplate> get_window_template(int16_t res_id, bool is_dialog) {
+    auto data_handle = GetResource(is_dialog ? ResourceDASM::RESOURCE_TYPE_DLOG : ResourceDASM::RESOURCE_TYPE_WIND, res_id);
+    auto it = this->window_templates.find(data_handle);
+    if (it != this->window_templates.end()) {
+      return it->second;
+    }
+
+    auto ret = std::make_shared<WindowTemplate>();
+    ret->ditl_resource_id = 0;
+    if (is_dialog) {
+      auto dlog = ResourceFile::decode_DLOG(*data_handle, GetHandleSize(data_handle));
+      ret->bounds = copy_rect(dlog.bounds);
+      ret->proc_id = dlog.proc_id;
+      ret->title = dlog.title;
+      ret->visible = dlog.visible;
+      ret->go_away = dlog.go_away;
+      ret->ref_con = dlog.ref_con;
+      ret->ditl_resource_id = dlog.items_id;
+
+      auto ditl_handle = GetResource(ResourceDASM::RESOURCE_TYPE_DITL, dlog.items_id);
+      ret->item_defs = ResourceFile::decode_DITL(*ditl_handle, GetHandleSize(ditl_handle));
+      this->evict_window_template_on_dispose(ditl_handle, data_handle);
+
+    } else {
+      auto wind = ResourceFile::decode_WIND(*data_handle, GetHandleSize(data_handle));
+      ret->bounds = copy_rect(wind.bounds);
+      ret->proc_id = wind.proc_id;
+      ret->title = wind.title;
+      ret->visible = wind.visible;
+      ret->go_away = wind.go_away;
+      ret->ref_con = wind.ref_con;
+    }
+
+    // If there's a corresponding dctb or wctb, use it to initialize the port's background color. It seems none of the other fields are relevant: they're used for drawing the window frame, but Realmz only uses borderless windows.
+    ret->background_color = {0xFFFF, 0xFFFF, 0xFFFF};
+    try {
+      auto clut_data = GetResource(is_dialog ? ResourceDASM::RESOURCE_TYPE_dctb : ResourceDASM::RESOURCE_TYPE_wctb, res_id);
+      if (clut_data) {
+        auto clut = ResourceFile::decode_dctb(*clut_data, GetHandleSize(clut_data));
+        ret->background_color.red = clut.at(0).c.r;
+        ret->background_color.green = clut.at(0).c.g;
+        ret->background_color.blue = clut.at(0).c.b;
+        this->evict_window_template_on_dispose(clut_data, data_handle);
+      }
+    } catch (const std::out_of_range&) {
+    }
+
+    this->evict_window_template_on_dispose(data_handle, data_handle);
+    this->window_templates.emplace(data_handle, ret);
+    return ret;
+  }
+
+  ControlTemplate get_control_template(int16_t res_id) {
+    auto data_handle = GetResource(ResourceDASM::RESOURCE_TYPE_CNTL, res_id);
+    auto it = this->control_templates.find(data_handle);
+    if (it != this->control_templates.end()) {
+      return it->second;
+    }
+
+    auto def = ResourceFile::decode_CNTL(*data_handle, GetHandleSize(data_handle));
+    ControlTemplate ret;
+    ret.bounds = copy_rect(def.bounds);
+    ret.value = def.value;
+    ret.min = def.min;
+    ret.max = def.max;
+    ret.proc_id = def.proc_id;
+    ret.visible = def.visible;
+    ret.title = def.title;
+    add_destroy_callback(data_handle, &ResourceTemplateCache::evict_control_template, data_handle);
+    this->control_templates.emplace(data_handle, ret);
+    return ret;
+  }
+
+private:
+  std::unordered_map<Handle, std::shared_ptr<const WindowTemplate>> window_templates;
+  std::unordered_map<Handle, ControlTemplate> control_templates;
+
+  ResourceTemplateCache() = default;
+
+  static void evict_control_template(void* key) {
+    instance().control_templates.erase(reinterpret_cast<Handle>(key));
+  }
+  static void evict_window_template(void* key) {
+    instance().window_templates.erase(reinterpret_cast<Handle>(key));
+  }
+
+  // When a DITL or dctb is purged, the template is rebuilt later, but the
+  // callbacks on its other resources are still registered. This doesn't add
+  // duplicates (see add_destroy_callback), so they don't pile up.
+  void evict_window_template_on_dispose(Handle dependency, Handle key) {
+    add_destroy_callback(dependency, &ResourceTemplateCache::evict_window_template, key);
+  }
+};
 
 using DialogItemType = ResourceDASM::ResourceFile::DecodedDialogItem::Type;
 
@@ -117,8 +370,6 @@ const char* phosg::name_for_enum<DialogItemType>(DialogItemType type) {
 ////////////////////////////////////////////////////////////////////////////////
 // Controls
 
-struct DialogItem;
-
 enum class ControlType {
   // The values here match proc_id in the CNTL resource. There are more of
   // these, but we probably won't need them
@@ -138,7 +389,7 @@ enum class ControlType {
 struct Control {
   std::weak_ptr<DialogItem> dialog_item; // May be null for dynamically-created controls!
   int32_t cntl_resource_id; // 0x00010000 = not from a resource
-  size_t opaque_handle;
+  size_t opaque_handle; // Same as the owning DialogItem's handle; zero until it's created
   ControlType type;
   Rect bounds;
   int16_t value;
@@ -159,7 +410,7 @@ protected:
       const std::string& title) {
     auto ret = std::make_shared<Control>();
     ret->cntl_resource_id = cntl_res_id;
-    ret->opaque_handle = generate_opaque_handle();
+    ret->opaque_handle = 0;
     switch (proc_id) {
       case 0:
         ret->type = ControlType::BUTTON;
@@ -211,10 +462,8 @@ public:
   }
   // Create a new control from a resource. This implements the GetNewControl syscall.
   static std::shared_ptr<Control> from_CNTL(int16_t cntl_resource_id) {
-    auto data_handle = GetResource(ResourceDASM::RESOURCE_TYPE_CNTL, cntl_resource_id);
-    auto def = ResourceDASM::ResourceFile::decode_CNTL(*data_handle, GetHandleSize(data_handle));
-    Rect bounds = copy_rect(def.bounds);
-    return Control::make_shared(cntl_resource_id, bounds, def.value, def.min, def.max, def.proc_id, def.visible, def.title);
+    auto def = ResourceTemplateCache::instance().get_control_template(cntl_resource_id);
+    return Control::make_shared(cntl_resource_id, def.bounds, def.value, def.min, def.max, def.proc_id, def.visible, def.title);
   }
   // Create a new control from a dialog item. This implements controls
   // generated from DITL entries. Annoyingly, this can't be implemented here
@@ -252,6 +501,109 @@ public:
 ////////////////////////////////////////////////////////////////////////////////
 // Dialog items
 
+// Each distinct control part is rendered once and kept, so redrawing a
+// control is a couple of blits instead of a series of primitive draws and
+// color changes. Sprites are keyed by everything that affects their pixels.
+class ControlSpriteCache {
+public:
+  enum class Part : uint8_t {
+    // Gray track with a black arrow box at each end; w x h
+    SCROLL_BAR_BODY = 0,
+    // Outlined square in color1 with a transparent interior; w x w
+    SCROLL_BAR_THUMB,
+    // Box outline in color1 with an X through it and a transparent interior;
+    // always CHECKBOX_SIZE + 1 pixels square
+    CHECKBOX_CHECKED,
+    // Box outline in color1 with its interior erased to color2
+    CHECKBOX_UNCHECKED,
+  };
+  static constexpr int16_t CHECKBOX_SIZE = 12;
+
+  static ControlSpriteCache& instance() {
+    static ControlSpriteCache cache;
+    return cache;
+  }
+
+  const phosg::ImageRGBA8888N& get(Part part, int16_t w, int16_t h, uint32_t color1 = 0, uint32_t color2 = 0) {
+    Key key{.part = part, .w = w, .h = h, .color1 = color1, .color2 = color2};
+    auto it = this->sprites.find(key);
+    if (it != this->sprites.end()) {
+      return it->second;
+    }
+    // Controls come in only a handful of sizes, so this should never happen
+    // in practice; it just keeps a pathological case from growing forever
+    if (this->sprites.size() >= MAX_SPRITES) {
+      this->sprites.clear();
+    }
+    return this->sprites.emplace(key, render(key)).first->second;
+  }
+
+private:
+  static constexpr size_t MAX_SPRITES = 256;
+
+  struct Key {
+    Part part;
+    int16_t w;
+    int16_t h;
+    uint32_t color1;
+    uint32_t color2;
+    bool operator==(const Key& other) const = default;
+  };
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      uint64_t a = (static_cast<uint64_t>(k.part) << 32) | (static_cast<uint64_t>(static_cast<uint16_t>(k.w)) << 16) | static_cast<uint16_t>(k.h);
+      uint64_t b = (static_cast<uint64_t>(k.color1) << 32) | k.color2;
+      return std::hash<uint64_t>()(a) ^ (std::hash<uint64_t>()(b) * 0x9E3779B97F4A7C15ULL);
+    }
+  };
+  std::unordered_map<Key, phosg::ImageRGBA8888N, KeyHash> sprites;
+
+  ControlSpriteCache() = default;
+
+  // These draw exactly what DialogItem::render_in_port draws with primitives
+  // when it doesn't use the cache
+  static phosg::ImageRGBA8888N render(const Key& key) {
+    switch (key.part) {
+      case Part::SCROLL_BAR_BODY: {
+        phosg::ImageRGBA8888N ret(key.w, key.h);
+        ret.write_rect(0, 0, key.w, key.h, rgba8888_for_rgb_color(RGBColor{0x6666, 0x6666, 0x6666}));
+        uint32_t arrow_color = rgba8888_for_rgb_color(RGBColor{0x0000, 0x0000, 0x0000});
+        ret.write_rect(0, 0, key.w, key.w, arrow_color);
+        ret.write_rect(0, key.h - key.w, key.w, key.w, arrow_color);
+        return ret;
+      }
+      case Part::SCROLL_BAR_THUMB: {
+        phosg::ImageRGBA8888N ret(key.w, key.w);
+        ret.write_rect(0, 0, key.w, key.w, 0x00000000);
+        ret.draw_horizontal_line(0, key.w - 1, 0, 0, key.color1);
+        ret.draw_horizontal_line(0, key.w - 1, key.w - 1, 0, key.color1);
+        ret.draw_vertical_line(0, 0, key.w - 1, 0, key.color1);
+        ret.draw_vertical_line(key.w - 1, 0, key.w - 1, 0, key.color1);
+        return ret;
+      }
+      case Part::CHECKBOX_CHECKED:
+      case Part::CHECKBOX_UNCHECKED: {
+        constexpr int16_t s = CHECKBOX_SIZE;
+        phosg::ImageRGBA8888N ret(s + 1, s + 1);
+        ret.write_rect(0, 0, s + 1, s + 1, 0x00000000);
+        ret.draw_line(0, 0, 0, s, key.color1);
+        ret.draw_line(s, 0, s, s, key.color1);
+        ret.draw_line(0, 0, s, 0, key.color1);
+        ret.draw_line(0, s, s, s, key.color1);
+        if (key.part == Part::CHECKBOX_CHECKED) {
+          ret.draw_line(0, 0, s, s, key.color1);
+          ret.draw_line(s, 0, 0, s, key.color1);
+        } else {
+          ret.write_rect(1, 1, s - 2, s - 2, key.color2);
+        }
+        return ret;
+      }
+      default:
+        throw std::logic_error("Invalid control sprite part");
+    }
+  }
+};
+
 // This structure is "private" (not accessible in C) because it isn't directly
 // used there: Realmz only interacts with dialog items through syscalls and
 // handles, so we can use C++ types here without breaking anything.
@@ -272,10 +624,17 @@ public:
   bool enabled;
   std::shared_ptr<Control> control; // May be null
 
-  static std::unordered_map<size_t, std::weak_ptr<DialogItem>> all_items;
+  // Retained rendering state; see Window::erase_and_render. render_dirty is set
+  // whenever anything that affects this item's appearance changes, and
+  // last_rendered_bounds is the area the item covered in the window's retained
+  // image when it was last rendered there.
+  bool render_dirty = true;
+  Rect last_rendered_bounds{0, 0, 0, 0};
+
+  static DialogItemHandleTable handle_table;
 
   static std::shared_ptr<DialogItem> get_item_by_handle(size_t handle) {
-    auto item = DialogItem::all_items.at(handle).lock();
+    auto item = DialogItem::handle_table.get(handle);
     if (!item) {
       throw std::logic_error(std::format(
           "Attempted to get missing or destroyed dialog item (handle was {})", handle));
@@ -285,6 +644,7 @@ public:
 
 private:
   std::string text;
+  mutable ParamTextCache param_text_cache;
 
 public:
   // Constructor from a definition
@@ -292,7 +652,7 @@ public:
       int32_t ditl_res_id,
       size_t item_id,
       const ResourceDASM::ResourceFile::DecodedDialogItem& def)
-      : opaque_handle{generate_opaque_handle()},
+      : opaque_handle{handle_table.allocate()},
         ditl_resource_id{ditl_res_id},
         item_id{item_id},
         type{def.type},
@@ -307,7 +667,7 @@ public:
   }
   // Constructor from a control
   DialogItem(std::shared_ptr<Control> control)
-      : opaque_handle{control->opaque_handle},
+      : opaque_handle{handle_table.allocate()},
         ditl_resource_id{0x00010000},
         item_id{0},
         type{DialogItemType::UNKNOWN},
@@ -316,6 +676,7 @@ public:
         enabled{true},
         control{control},
         text{control->title} {
+    control->opaque_handle = this->opaque_handle;
     switch (control->type) {
       case ControlType::BUTTON:
         this->type = DialogItemType::BUTTON;
@@ -342,7 +703,7 @@ public:
   }
 
   DialogItem(DialogItemType type, const Rect& disp_rect, const Rect& view_rect)
-      : opaque_handle{generate_opaque_handle()},
+      : opaque_handle{handle_table.allocate()},
         type{type},
         text{""},
         enabled{true},
@@ -358,16 +719,15 @@ public:
     }
   }
 
-  // Create a list of dialog items from a DITL resource
-  static std::vector<std::shared_ptr<DialogItem>> from_DITL(int16_t ditl_resource_id) {
-    auto data_handle = GetResource(ResourceDASM::RESOURCE_TYPE_DITL, ditl_resource_id);
-    auto defs = ResourceDASM::ResourceFile::decode_DITL(*data_handle, GetHandleSize(data_handle));
-
+  // Create a list of dialog items from a decoded DITL resource
+  static std::vector<std::shared_ptr<DialogItem>> from_DITL(
+      int16_t ditl_resource_id, const std::vector<ResourceFile::DecodedDialogItem>& defs) {
     std::vector<std::shared_ptr<DialogItem>> ret;
+    ret.reserve(defs.size());
     for (const auto& decoded_dialog_item : defs) {
       size_t item_id = ret.size() + 1;
       auto di = ret.emplace_back(new DialogItem(ditl_resource_id, item_id, decoded_dialog_item));
-      all_items[di->opaque_handle] = di;
+      handle_table.set(di->opaque_handle, di);
     }
     return ret;
   }
@@ -378,18 +738,18 @@ public:
   static std::shared_ptr<DialogItem> from_control(std::shared_ptr<Control> control) {
     auto ret = std::make_shared<DialogItem>(control);
     control->dialog_item = ret;
-    all_items[ret->opaque_handle] = ret;
+    handle_table.set(ret->opaque_handle, ret);
     return ret;
   }
 
   static std::shared_ptr<DialogItem> from_text_edit(const Rect& dest_rect, const Rect& view_rect) {
     auto ret = std::make_shared<DialogItem>(DialogItemType::TEXT, dest_rect, view_rect);
-    all_items[ret->opaque_handle] = ret;
+    handle_table.set(ret->opaque_handle, ret);
     return ret;
   }
 
   ~DialogItem() {
-    all_items.erase(opaque_handle);
+    handle_table.release(opaque_handle);
   }
 
   std::string str() const {
@@ -428,6 +788,7 @@ public:
     if (erase_background) {
       port.erase_rect(this->rect);
     }
+    const auto& processed_text = this->param_text_cache.get(this->text);
     switch (type) {
       case ResourceFile::DecodedDialogItem::Type::PICTURE: {
         auto pict_handle = GetPicture(resource_id);
@@ -443,19 +804,19 @@ public:
         wm_log.warning_f("Attempted to draw ICON dialog item, but it's not implemented");
         break;
       case ResourceFile::DecodedDialogItem::Type::TEXT: {
-        if (text.length() > 0 && !port.draw_text(text, this->rect)) {
+        if (processed_text.length() > 0 && !port.draw_processed_text(processed_text, this->rect)) {
           wm_log.error_f("Error when rendering text item {}: {}", resource_id, SDL_GetError());
         }
         break;
       }
       case ResourceFile::DecodedDialogItem::Type::BUTTON: {
-        if (!port.draw_text(text, this->rect)) {
+        if (!port.draw_processed_text(processed_text, this->rect)) {
           wm_log.error_f("Error when rendering button text item {}: {}", resource_id, SDL_GetError());
         }
         break;
       }
       case ResourceFile::DecodedDialogItem::Type::EDIT_TEXT: {
-        if (!port.draw_text(text, this->rect)) {
+        if (!port.draw_processed_text(processed_text, this->rect)) {
           wm_log.error_f("Error when rendering editable text item {}: {}", resource_id, SDL_GetError());
         }
         break;
@@ -465,7 +826,13 @@ public:
         // TODO: For now, we just draw radio buttons the same as checkboxes. (Does Realmz even use radio buttons?)
         // Draw checkbox
         const auto& r = this->rect;
-        constexpr size_t size = 12;
+        if (this->render_checkbox_sprite(port)) {
+          if (!port.draw_processed_text(processed_text, Rect{r.top, static_cast<int16_t>(r.left + 12), r.bottom, r.right})) {
+            wm_log.error_f("Error when rendering button text item {}: {}", resource_id, SDL_GetError());
+          }
+          break;
+        }
+        constexpr size_t size = ControlSpriteCache::CHECKBOX_SIZE;
         Point top_left = {.h = r.left, .v = r.top};
         Point top_right = {.h = static_cast<int16_t>(r.left + size), .v = r.top};
         Point bottom_left = {.h = r.left, .v = static_cast<int16_t>(r.top + size)};
@@ -489,7 +856,7 @@ public:
         }
         int16_t h = get_height();
         int16_t w = get_width();
-        if (!port.draw_text(text, Rect{r.top, static_cast<int16_t>(r.left + 12), r.bottom, r.right})) {
+        if (!port.draw_processed_text(processed_text, Rect{r.top, static_cast<int16_t>(r.left + 12), r.bottom, r.right})) {
           wm_log.error_f("Error when rendering button text item {}: {}", resource_id, SDL_GetError());
         }
         break;
@@ -499,6 +866,9 @@ public:
           wm_log.error_f("Could not render resource control {} that is not a scrollbar", resource_id);
           break;
         }
+        if (this->render_scroll_bar_sprites(port)) {
+          break;
+        }
         RGBColor prev_color;
         RGBColor prev_bg_color;
         GetForeColor(&prev_color);
@@ -561,6 +931,68 @@ public:
     }
   }
 
+  // The sprite paths are used only when they produce exactly what the
+  // primitive paths would. Otherwise (e.g. with a background pattern, or a
+  // control that extends past the edge of the port), these return false and
+  // render_in_port draws the control the slow way.
+  bool render_checkbox_sprite(CCGrafPort& port) const {
+    const auto& r = this->rect;
+    constexpr int16_t s = ControlSpriteCache::CHECKBOX_SIZE;
+    if (port.pnMode != 0x00 || port.bkPixPat ||
+        r.left < 0 || r.top < 0 ||
+        static_cast<size_t>(r.left + s + 1) > port.get_width() ||
+        static_cast<size_t>(r.top + s + 1) > port.get_height()) {
+      return false;
+    }
+    bool checked = this->control && this->control->value;
+    const auto& sprite = ControlSpriteCache::instance().get(
+        checked ? ControlSpriteCache::Part::CHECKBOX_CHECKED : ControlSpriteCache::Part::CHECKBOX_UNCHECKED,
+        s + 1, s + 1,
+        rgba8888_for_rgb_color(port.rgbFgColor),
+        checked ? 0 : rgba8888_for_rgb_color(port.rgbBgColor));
+    port.data.copy_from_with_blend(sprite, r.left, r.top, s + 1, s + 1, 0, 0);
+    return true;
+  }
+
+  bool render_scroll_bar_sprites(CCGrafPort& port) const {
+    // The primitive path sets its colors on the current port, so it only
+    // draws in those colors when it's drawing into the current port
+    const auto& r = this->rect;
+    auto w = this->get_width();
+    auto h = this->get_height();
+    auto slider_offset = this->get_slider_offset();
+    int16_t thumb_top = r.top + w + slider_offset;
+    if (&port != qd.thePort || port.bkPixPat || (w <= 0) || (h < 3 * w) ||
+        r.left < 0 || r.top < 0 || thumb_top < r.top || thumb_top + w > r.bottom ||
+        static_cast<size_t>(r.right) > port.get_width() ||
+        static_cast<size_t>(r.bottom) > port.get_height()) {
+      return false;
+    }
+    auto& cache = ControlSpriteCache::instance();
+    port.data.copy_from(cache.get(ControlSpriteCache::Part::SCROLL_BAR_BODY, w, h), r.left, r.top, w, h, 0, 0);
+    uint32_t thumb_color = rgba8888_for_rgb_color((slider_offset > 0)
+            ? RGBColor{0xFFFF, 0xFFFF, 0x0000}
+            : RGBColor{0x0000, 0x0000, 0x0000});
+    port.data.copy_from_with_blend(
+        cache.get(ControlSpriteCache::Part::SCROLL_BAR_THUMB, w, w, thumb_color), r.left, thumb_top, w, w, 0, 0);
+    return true;
+  }
+
+  // Returns the area that render_in_port may draw into. This is the item's
+  // rect, except for checkboxes, whose box is drawn at a fixed size.
+  Rect render_bounds() const {
+    Rect ret = this->rect;
+    if (this->type == DialogItemType::CHECKBOX || this->type == DialogItemType::RADIO_BUTTON) {
+      ret.right = std::max<int16_t>(ret.right, ret.left + 13);
+      ret.bottom = std::max<int16_t>(ret.bottom, ret.top + 13);
+    }
+    return ret;
+  }
+
+  inline void mark_dirty() {
+    this->render_dirty = true;
+  }
+
   inline int16_t get_width() const {
     return rect.right - rect.left;
   }
@@ -575,12 +1007,16 @@ public:
 
   void set_text(const std::string& new_text) {
     text = new_text;
+    param_text_cache.invalidate();
+    this->mark_dirty();
     if (control) {
       control->title = text;
     }
   }
   void set_text(std::string&& new_text) {
     text = std::move(new_text);
+    param_text_cache.invalidate();
+    this->mark_dirty();
     if (control) {
       control->title = text;
     }
@@ -588,17 +1024,22 @@ public:
 
   void append_text(const std::string& new_text) {
     text += new_text;
+    param_text_cache.invalidate();
+    this->mark_dirty();
   }
 
   void delete_char() {
     if (!text.empty()) {
       text.pop_back();
+      param_text_cache.invalidate();
+      this->mark_dirty();
     }
   }
 
   void set_control_visible(bool visible) {
     if (this->control && (this->control->visible != visible)) {
       this->control->visible = visible;
+      this->mark_dirty();
     }
   }
 
@@ -612,6 +1053,8 @@ public:
       bounds.right = bounds.left + width;
       bounds.bottom = bounds.top + height;
       this->rect = bounds;
+      this->mark_dirty();
+      this->on_rect_changed();
     }
   }
 
@@ -621,6 +1064,15 @@ public:
       bounds.right = bounds.left + w;
       bounds.bottom = bounds.top + h;
       this->rect = bounds;
+      this->mark_dirty();
+      this->on_rect_changed();
+    }
+  }
+
+  void on_rect_changed() {
+    auto window = this->owner_window.lock();
+    if (window) {
+      window->invalidate_hit_grid();
     }
   }
 
@@ -663,6 +1115,7 @@ public:
   void set_control_value(short value) {
     if (this->control && (this->control->value != value)) {
       this->control->value = value;
+      this->mark_dirty();
     }
   }
 
@@ -671,6 +1124,7 @@ public:
       this->control->min = min;
       this->control->max = std::max<int16_t>(this->control->max, this->control->min);
       this->control->value = std::max<int16_t>(this->control->min, this->control->value);
+      this->mark_dirty();
     }
   }
 
@@ -679,11 +1133,12 @@ public:
       this->control->max = max;
       this->control->min = std::min<int16_t>(this->control->max, this->control->min);
       this->control->value = std::min<int16_t>(this->control->max, this->control->value);
+      this->mark_dirty();
     }
   }
 };
 
-std::unordered_map<size_t, std::weak_ptr<DialogItem>> DialogItem::all_items;
+DialogItemHandleTable DialogItem::handle_table;
 
 std::shared_ptr<Control> Control::from_dialog_item(const DialogItem& item) {
   ControlType type;
@@ -697,8 +1152,11 @@ std::shared_ptr<Control> Control::from_dialog_item(const DialogItem& item) {
     case DialogItemType::RADIO_BUTTON:
       type = ControlType::RADIO_BUTTON;
       break;
-    case DialogItemType::RESOURCE_CONTROL:
-      return Control::from_CNTL(item.resource_id);
+    case DialogItemType::RESOURCE_CONTROL: {
+      auto ret = Control::from_CNTL(item.resource_id);
+      ret->opaque_handle = item.opaque_handle;
+      return ret;
+    }
     default:
       return nullptr;
   }
@@ -735,6 +1193,7 @@ Window::Window(
       window_kind{window_kind},
       visible(visible),
       is_dialog_flag{is_dialog},
+      template_id{NO_TEMPLATE_ID},
       dialog_items{std::move(dialog_items)},
       focused_item{nullptr} {
   port.rgbBgColor = background_color;
@@ -747,6 +1206,10 @@ Window::Window(
     phosg::fwrite_fmt(stderr, "Warning: Creating non-borderless window\n");
   }
 
+  this->sort_dialog_items();
+}
+
+void Window::sort_dialog_items() {
   for (auto di : this->dialog_items) {
     // Set the focused text field to be the first EDIT_TEXT item encountered
     if (!focused_item && di->type == DialogItemType::EDIT_TEXT) {
@@ -781,10 +1244,47 @@ std::shared_ptr<Window> Window::make_shared(
   return ret;
 }
 
+void Window::release_dialog_items() {
+  this->dialog_items.clear();
+  this->static_items.clear();
+  this->control_items.clear();
+  this->text_items.clear();
+  this->focused_item.reset();
+  this->invalidate_retained_image();
+  this->invalidate_hit_grid();
+}
+
+void Window::reinitialize(
+    const std::string& title,
+    const Rect& bounds,
+    int16_t window_kind,
+    bool visible,
+    const RGBColor& background_color,
+    std::vector<std::shared_ptr<DialogItem>>&& dialog_items) {
+  this->log.debug_f("Window::reinitialize(\"{}\", {{x0={}, y0={}, x1={}, y1={}}}, ...)", title, bounds.left, bounds.top, bounds.right, bounds.bottom);
+  this->title = title;
+  this->port.reset_state();
+  this->port.portRect = bounds;
+  this->port.resize(bounds.right - bounds.left, bounds.bottom - bounds.top);
+  this->port.rgbBgColor = background_color;
+  this->window_kind = window_kind;
+  this->visible = visible;
+  WindowManager::instance().invalidate_window_hit_list();
+
+  this->release_dialog_items();
+  this->dialog_items = std::move(dialog_items);
+  this->sort_dialog_items();
+  for (auto& di : this->dialog_items) {
+    di->owner_window = this->weak_from_this();
+  }
+}
+
 void Window::add_dialog_item(std::shared_ptr<DialogItem> item) {
   item->item_id = this->dialog_items.size();
   this->dialog_items.emplace_back(item);
   item->owner_window = this->weak_from_this();
+  this->invalidate_retained_image();
+  this->invalidate_hit_grid();
 
   this->log.debug_f("Window::add_dialog_item({})", item->str());
   item->render_in_port(this->port, false);
@@ -817,9 +1317,37 @@ void Window::delete_char(std::shared_ptr<DialogItem> item) {
   WindowManager::instance().recomposite_from_window(this->port);
 }
 
-void Window::erase_and_render() {
+Window::RenderSignature Window::current_render_signature() const {
+  return RenderSignature{
+      .tx_font = this->port.txFont,
+      .tx_size = this->port.txSize,
+      .tx_face = this->port.txFace,
+      .pn_mode = this->port.pnMode,
+      .fg_color = rgba8888_for_rgb_color(this->port.rgbFgColor),
+      .bg_color = rgba8888_for_rgb_color(this->port.rgbBgColor),
+      .bk_pix_pat = this->port.bkPixPat,
+      .param_text_generation = param_text_generation(),
+      .width = this->port.get_width(),
+      .height = this->port.get_height(),
+  };
+}
+
+void Window::invalidate_retained_image() {
+  this->retained_image_valid = false;
+}
+
+void Window::save_retained_image() {
+  size_t w = this->port.get_width();
+  size_t h = this->port.get_height();
+  if (this->retained_image.get_width() != w || this->retained_image.get_height() != h) {
+    this->retained_image.resize(w, h);
+  }
+  this->retained_image.copy_from(this->port.data, 0, 0, w, h, 0, 0);
+  this->retained_image_valid = true;
+}
+
+void Window::render_all_items() {
   // Clear the backbuffer before drawing frame
-  this->log.debug_f("Window::erase_and_render({:016X})", reinterpret_cast<intptr_t>(&this->port));
   this->port.erase_rect(this->port.to_local_space(this->port.portRect));
 
   // The DrawDialog procedure draws the entire contents of the specified dialog box. The
@@ -828,14 +1356,94 @@ void Window::erase_and_render() {
   // update all static and editable text items and to draw their display rectangles. The
   // DrawDialog procedure also calls the application-defined items’ draw procedures if
   // the items’ rectangles are within the update region.
-  for (auto item : this->static_items) {
-    item->render_in_port(this->port, false);
+  for (const auto* items : {&this->static_items, &this->control_items, &this->text_items}) {
+    for (const auto& item : *items) {
+      item->render_in_port(this->port, false);
+      item->render_dirty = false;
+      item->last_rendered_bounds = item->render_bounds();
+    }
+  }
+}
+
+void Window::render_dirty_items() {
+  // Items are redrawn in the same order that render_all_items draws them, so
+  // the result is the same as a full redraw
+  std::vector<DialogItem*> items;
+  for (const auto* item_list : {&this->static_items, &this->control_items, &this->text_items}) {
+    for (const auto& item : *item_list) {
+      items.emplace_back(item.get());
+    }
   }
-  for (auto item : this->control_items) {
-    item->render_in_port(this->port, false);
+
+  std::vector<bool> should_render(items.size(), false);
+  std::vector<Rect> restore_rects;
+  for (size_t z = 0; z < items.size(); z++) {
+    if (items[z]->render_dirty) {
+      should_render[z] = true;
+      restore_rects.emplace_back(items[z]->last_rendered_bounds);
+      restore_rects.emplace_back(items[z]->render_bounds());
+    }
   }
-  for (auto item : this->text_items) {
-    item->render_in_port(this->port, false);
+
+  // Any item that overlaps an area being restored has to be redrawn too, which
+  // means its own area has to be restored first, which may pull in more items
+  bool changed = !restore_rects.empty();
+  while (changed) {
+    changed = false;
+    for (size_t z = 0; z < items.size(); z++) {
+      if (should_render[z]) {
+        continue;
+      }
+      Rect bounds = items[z]->render_bounds();
+      for (const auto& r : restore_rects) {
+        if (rects_overlap(bounds, r)) {
+          should_render[z] = true;
+          restore_rects.emplace_back(bounds);
+          changed = true;
+          break;
+        }
+      }
+    }
+  }
+
+  this->port.data.copy_from(this->retained_image, 0, 0, this->port.get_width(), this->port.get_height(), 0, 0);
+  if (restore_rects.empty()) {
+    return;
+  }
+
+  this->log.debug_f("Window::render_dirty_items() restoring {} areas", restore_rects.size());
+  for (const auto& r : restore_rects) {
+    this->port.erase_rect(r);
+  }
+  for (size_t z = 0; z < items.size(); z++) {
+    if (should_render[z]) {
+      items[z]->render_in_port(this->port, false);
+      items[z]->render_dirty = false;
+      items[z]->last_rendered_bounds = items[z]->render_bounds();
+    }
+  }
+  this->save_retained_image();
+}
+
+void Window::erase_and_render() {
+  this->log.debug_f("Window::erase_and_render({:016X})", reinterpret_cast<intptr_t>(&this->port));
+
+  // If nothing outside the dialog items that affects rendering has changed
+  // since the last call, start from the retained result of that call and redraw
+  // only the items that have changed. Anything the game drew directly into the
+  // port in the meantime is discarded, just as the full erase would do.
+  auto signature = this->current_render_signature();
+  if (ENABLE_RETAINED_DIALOG_RENDERING &&
+      !ENABLE_DIALOG_RECOMPOSITE_DEBUG &&
+      this->retained_image_valid &&
+      (signature == this->retained_signature)) {
+    this->render_dirty_items();
+  } else {
+    this->render_all_items();
+    if (ENABLE_RETAINED_DIALOG_RENDERING) {
+      this->save_retained_image();
+      this->retained_signature = signature;
+    }
   }
 
   WindowManager::instance().recomposite_from_window(this->port);
@@ -851,6 +1459,7 @@ void Window::move(int x, int y) {
     bounds.right += x_delta;
     bounds.top += y_delta;
     bounds.bottom += y_delta;
+    WindowManager::instance().invalidate_window_hit_list();
     WindowManager::instance().recomposite_all();
   }
 }
@@ -860,6 +1469,8 @@ void Window::resize(uint16_t w, uint16_t h) {
 
   bool shrank_either_dimension = (this->get_width() > w) || (this->get_height() > h);
   this->port.resize(w, h);
+  this->invalidate_retained_image();
+  WindowManager::instance().invalidate_window_hit_list();
 
   // Recomposite everything if this window shrank in either dimension (since
   // windows behind it may be revealed); else, recomposite only this window
@@ -883,8 +1494,97 @@ const std::vector<std::shared_ptr<DialogItem>>& Window::get_dialog_items() const
   return this->dialog_items;
 }
 
-std::shared_ptr<DialogItem> Window::dialog_item_for_position(const Point& pt, bool enabled_only) {
+void Window::invalidate_hit_grid() {
+  this->hit_grid_valid = false;
+}
+
+void Window::rebuild_hit_grid() {
+  auto& g = this->hit_grid;
+  g.cols = 0;
+  g.rows = 0;
+  g.cell_offsets.clear();
+  g.item_indexes.clear();
+  this->hit_grid_valid = true;
+
+  bool any_items = false;
   for (const auto& item : this->dialog_items) {
+    const auto& r = item->rect;
+    if (r.left >= r.right || r.top >= r.bottom) {
+      continue; // PtInRect is never true for these
+    }
+    if (!any_items) {
+      g.bounds = r;
+      any_items = true;
+    } else {
+      g.bounds.left = std::min(g.bounds.left, r.left);
+      g.bounds.top = std::min(g.bounds.top, r.top);
+      g.bounds.right = std::max(g.bounds.right, r.right);
+      g.bounds.bottom = std::max(g.bounds.bottom, r.bottom);
+    }
+  }
+  if (!any_items) {
+    return;
+  }
+
+  int32_t w = g.bounds.right - g.bounds.left;
+  int32_t h = g.bounds.bottom - g.bounds.top;
+  int32_t cell_size = HIT_GRID_CELL_SIZE;
+  for (;;) {
+    g.cols = (w + cell_size - 1) / cell_size;
+    g.rows = (h + cell_size - 1) / cell_size;
+    if (g.cols * g.rows <= MAX_HIT_GRID_CELLS) {
+      break;
+    }
+    cell_size *= 2;
+  }
+  g.cell_size = cell_size;
+
+  // Count the items in each cell, then fill in the item lists. Items are
+  // visited in order, so each cell's list is in the same order as dialog_items
+  auto for_each_cell = [&](const Rect& r, auto&& fn) -> void {
+    size_t x0 = (r.left - g.bounds.left) / cell_size;
+    size_t x1 = (r.right - 1 - g.bounds.left) / cell_size;
+    size_t y0 = (r.top - g.bounds.top) / cell_size;
+    size_t y1 = (r.bottom - 1 - g.bounds.top) / cell_size;
+    for (size_t y = y0; y <= y1; y++) {
+      for (size_t x = x0; x <= x1; x++) {
+        fn(y * g.cols + x);
+      }
+    }
+  };
+  g.cell_offsets.assign(g.cols * g.rows + 1, 0);
+  for (const auto& item : this->dialog_items) {
+    const auto& r = item->rect;
+    if (r.left < r.right && r.top < r.bottom) {
+      for_each_cell(r, [&](size_t cell) { g.cell_offsets[cell + 1]++; });
+    }
+  }
+  for (size_t z = 1; z < g.cell_offsets.size(); z++) {
+    g.cell_offsets[z] += g.cell_offsets[z - 1];
+  }
+  g.item_indexes.resize(g.cell_offsets.back());
+  std::vector<uint32_t> next_index(g.cell_offsets.begin(), g.cell_offsets.end() - 1);
+  for (size_t z = 0; z < this->dialog_items.size(); z++) {
+    const auto& r = this->dialog_items[z]->rect;
+    if (r.left < r.right && r.top < r.bottom) {
+      for_each_cell(r, [&](size_t cell) { g.item_indexes[next_index[cell]++] = z; });
+    }
+  }
+  this->log.debug_f("Rebuilt hit grid: {}x{} cells of {}px for {} items",
+      g.cols, g.rows, g.cell_size, this->dialog_items.size());
+}
+
+std::shared_ptr<DialogItem> Window::dialog_item_for_position(const Point& pt, bool enabled_only) {
+  if (!this->hit_grid_valid) {
+    this->rebuild_hit_grid();
+  }
+  const auto& g = this->hit_grid;
+  if (g.cols == 0 || !PtInRect(pt, &g.bounds)) {
+    return nullptr;
+  }
+  size_t cell = ((pt.v - g.bounds.top) / g.cell_size) * g.cols + ((pt.h - g.bounds.left) / g.cell_size);
+  for (size_t z = g.cell_offsets[cell]; z < g.cell_offsets[cell + 1]; z++) {
+    const auto& item = this->dialog_items[g.item_indexes[z]];
     if ((!enabled_only || item->enabled) && PtInRect(pt, &item->rect)) {
       return item;
     }
@@ -912,6 +1612,8 @@ void Window::remove_text_edit(std::shared_ptr<DialogItem> item) {
   if (it != text_items.end()) {
     text_items.erase(it);
   }
+  this->invalidate_retained_image();
+  this->invalidate_hit_grid();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -947,17 +1649,28 @@ WindowPtr WindowManager::create_window(
     uint32_t ref_con,
     bool is_dialog,
     const RGBColor& background_color,
-    std::vector<std::shared_ptr<DialogItem>>&& dialog_items) {
+    std::vector<std::shared_ptr<DialogItem>>&& dialog_items,
+    int32_t template_id) {
   wm_log.debug_f("WindowManager::create_window(\"{}\", {{x0={}, y0={}, x1={}, y1={}}}, ...)", title, bounds.left, bounds.top, bounds.right, bounds.bottom);
 
-  auto window = Window::make_shared(title, bounds, proc_id, visible, is_dialog, background_color, std::move(dialog_items));
-  port_to_window.emplace(&window->get_port(), window);
-
-  // Maintain a shared lookup across all windows of their dialog items, by handle,
-  // to support functions that modify the DITLs directly, like SetDialogItemText
-  for (auto di : dialog_items) {
-    DialogItem::all_items[di->opaque_handle] = di;
+  // If a dialog created from the same DLOG was disposed recently, reuse it
+  // instead of allocating a new window and port
+  std::shared_ptr<Window> window;
+  if (template_id != Window::NO_TEMPLATE_ID) {
+    for (auto it = this->parked_windows.begin(); it != this->parked_windows.end(); it++) {
+      if (((*it)->template_id == template_id) && ((*it)->is_dialog() == is_dialog)) {
+        window = std::move(*it);
+        this->parked_windows.erase(it);
+        window->reinitialize(title, bounds, proc_id, visible, background_color, std::move(dialog_items));
+        break;
+      }
+    }
   }
+  if (!window) {
+    window = Window::make_shared(title, bounds, proc_id, visible, is_dialog, background_color, std::move(dialog_items));
+    window->template_id = template_id;
+  }
+  port_to_window.emplace(&window->get_port(), window);
 
   this->link_window_at_front(window);
   this->on_dialog_item_focus_changed();
@@ -984,13 +1697,26 @@ void WindowManager::destroy_window(WindowPtr port) {
   // TODO: figure out a better way of handling this.
   reset_mouse_state();
 
-  bool should_update_focus = (window_it->second == this->top_window);
-  this->unlink_window(window_it->second);
+  auto window = window_it->second;
+  bool should_update_focus = (window == this->top_window);
+  this->unlink_window(window);
   port_to_window.erase(window_it);
   if (should_update_focus) {
     this->on_dialog_item_focus_changed();
   }
 
+  // Keep dialogs created from DLOG resources around so they can be reused if
+  // the same DLOG is opened again. Their items are destroyed now, so any
+  // handles the game still holds for them become stale as usual.
+  if (window->template_id != Window::NO_TEMPLATE_ID) {
+    window->release_dialog_items();
+    window->visible = false;
+    this->parked_windows.emplace_back(std::move(window));
+    if (this->parked_windows.size() > MAX_PARKED_WINDOWS) {
+      this->parked_windows.erase(this->parked_windows.begin());
+    }
+  }
+
   // If the current port is this window's port, set the current port back to
   // the default port
   if (qd.thePort == port) {
@@ -1006,7 +1732,7 @@ std::shared_ptr<Window> WindowManager::window_for_port(WindowPtr port) {
 }
 
 std::shared_ptr<DialogItem> WindowManager::dialog_item_for_handle(DialogItemHandle handle) {
-  return dialog_items_by_handle.at(handle);
+  return DialogItem::get_item_by_handle(unwrap_opaque_handle(handle));
 }
 
 std::shared_ptr<Window> WindowManager::front_window() {
@@ -1022,6 +1748,7 @@ void WindowManager::link_window_at_front(std::shared_ptr<Window> w) {
   if (!this->bottom_window) {
     this->bottom_window = w;
   }
+  this->invalidate_window_hit_list();
   this->verify_window_stack();
 }
 
@@ -1040,6 +1767,7 @@ void WindowManager::unlink_window(std::shared_ptr<Window> w) {
   }
   w->window_below.reset();
   w->window_above.reset();
+  this->invalidate_window_hit_list();
   this->verify_window_stack();
 }
 
@@ -1058,15 +1786,28 @@ void WindowManager::bring_to_front(std::shared_ptr<Window> window) {
 }
 
 std::shared_ptr<Window> WindowManager::window_for_point(ssize_t x, ssize_t y) {
+  if (!this->window_hit_list_valid) {
+    this->window_hit_list.clear();
+    for (auto window = this->top_window; window; window = window->window_below) {
+      this->window_hit_list.emplace_back(window->port.portRect, window);
+    }
+    this->window_hit_list_valid = true;
+  }
   Point pt{.h = static_cast<int16_t>(x), .v = static_cast<int16_t>(y)};
-  for (auto window = this->top_window; window; window = window->window_below) {
-    if (PtInRect(pt, &window->port.portRect)) {
+  for (const auto& [rect, window] : this->window_hit_list) {
+    if (PtInRect(pt, &rect)) {
       return window;
     }
   }
   return nullptr;
 }
 
+void WindowManager::invalidate_window_hit_list() {
+  this->window_hit_list_valid = false;
+  // Don't keep references to windows that may have been destroyed
+  this->window_hit_list.clear();
+}
+
 void WindowManager::on_dialog_item_focus_changed() {
   // Macintosh Toolbox Essentials 6-32
 
@@ -1153,6 +1894,30 @@ void WindowManager::recomposite(std::shared_ptr<Window> updated_window) {
     }
   }
 
+  if (this->min_present_interval_ns && (SDL_GetTicksNS() - this->last_present_ns < this->min_present_interval_ns)) {
+    this->present_pending = true;
+    return;
+  }
+  this->present();
+}
+
+void WindowManager::set_min_present_interval_ns(uint64_t ns) {
+  this->min_present_interval_ns = ns;
+  if (!ns) {
+    this->present_if_pending();
+  }
+}
+
+void WindowManager::present_if_pending() {
+  if (this->present_pending) {
+    this->present();
+  }
+}
+
+void WindowManager::present() {
+  this->present_pending = false;
+  this->last_present_ns = SDL_GetTicksNS();
+
   if (this->sdl_window) {
     auto renderer = SDL_GetRenderer(this->sdl_window.get());
     if (!renderer) {
@@ -1359,69 +2124,29 @@ void WindowManager_Init(void) {
   TTF_Init();
 
   init_fonts();
+
+  apply_animation_speed_from_environment();
 }
 
 WindowPtr WindowManager_CreateNewWindow(int16_t res_id, bool is_dialog, WindowPtr behind) {
-  Rect bounds;
-  int16_t proc_id;
-  std::string title;
-  bool visible;
-  bool go_away;
-  uint32_t ref_con;
-  size_t num_dialog_items;
-  std::vector<std::shared_ptr<DialogItem>> dialog_items;
+  auto tmpl = ResourceTemplateCache::instance().get_window_template(res_id, is_dialog);
 
+  std::vector<std::shared_ptr<DialogItem>> dialog_items;
   if (is_dialog) {
-    auto data_handle = GetResource(ResourceDASM::RESOURCE_TYPE_DLOG, res_id);
-    auto dlog = ResourceDASM::ResourceFile::decode_DLOG(*data_handle, GetHandleSize(data_handle));
-    bounds.left = dlog.bounds.x1;
-    bounds.right = dlog.bounds.x2;
-    bounds.top = dlog.bounds.y1;
-    bounds.bottom = dlog.bounds.y2;
-    proc_id = dlog.proc_id;
-    title = dlog.title;
-    visible = dlog.visible;
-    go_away = dlog.go_away;
-    ref_con = dlog.ref_con;
-    dialog_items = DialogItem::from_DITL(dlog.items_id);
-
-  } else {
-    auto data_handle = GetResource(ResourceDASM::RESOURCE_TYPE_WIND, res_id);
-    auto wind = ResourceDASM::ResourceFile::decode_WIND(*data_handle, GetHandleSize(data_handle));
-    bounds.left = wind.bounds.x1;
-    bounds.right = wind.bounds.x2;
-    bounds.top = wind.bounds.y1;
-    bounds.bottom = wind.bounds.y2;
-    proc_id = wind.proc_id;
-    title = wind.title;
-    visible = wind.visible;
-    go_away = wind.go_away;
-    ref_con = wind.ref_con;
-  }
-
-  // If there's a corresponding dctb or wctb, use it to initialize the port's background color. It seems none of the other fields are relevant: they're used for drawing the window frame, but Realmz only uses borderless windows.
-  RGBColor background_color = {0xFFFF, 0xFFFF, 0xFFFF};
-  try {
-    auto clut_data = GetResource(is_dialog ? ResourceDASM::RESOURCE_TYPE_dctb : ResourceDASM::RESOURCE_TYPE_wctb, res_id);
-    if (clut_data) {
-      auto clut = ResourceDASM::ResourceFile::decode_dctb(*clut_data, GetHandleSize(clut_data));
-      background_color.red = clut.at(0).c.r;
-      background_color.green = clut.at(0).c.g;
-      background_color.blue = clut.at(0).c.b;
-    }
-  } catch (const std::out_of_range&) {
+    dialog_items = DialogItem::from_DITL(tmpl->ditl_resource_id, tmpl->item_defs);
   }
 
   return WindowManager::instance().create_window(
-      title,
-      bounds,
-      visible,
-      go_away,
-      proc_id,
-      ref_con,
+      tmpl->title,
+      tmpl->bounds,
+      tmpl->visible,
+      tmpl->go_away,
+      tmpl->proc_id,
+      tmpl->ref_con,
       is_dialog,
-      background_color,
-      std::move(dialog_items));
+      tmpl->background_color,
+      std::move(dialog_items),
+      is_dialog ? res_id : Window::NO_TEMPLATE_ID);
 }
 
 void WindowManager_DrawDialog(WindowPtr theWindow) {
@@ -1564,8 +2289,8 @@ Boolean DialogSelect(const EventRecord* ev, DialogPtr* dialog, short* item_hit)
     }
   }
 
-  // Backspace
-  if (ev->what == keyDown && (mac_vk_from_message(ev->message) == MAC_VK_BACKSPACE)) {
+  // Backspace (held down, it repeats as autoKey events)
+  if ((ev->what == keyDown || ev->what == autoKey) && (mac_vk_from_message(ev->message) == MAC_VK_BACKSPACE)) {
     auto item = window->get_focused_item();
     if (!item) {
       return false;
@@ -1696,8 +2421,11 @@ void ModalDialog(ModalFilterProcPtr filterProc, short* itemHit) {
   EventRecord e;
   DialogPtr dialog;
   short item;
+
+  // Block until input arrives instead of polling. Nothing here needs null
+  // events: we don't call filter procs, and we don't draw a blinking caret.
   do {
-    WaitNextEvent(everyEvent, &e, 1, NULL);
+    wait_next_event_ms(&e, -1);
   } while (e.window_port != port || !IsDialogEvent(&e) || !DialogSelect(&e, &dialog, &item));
 
   *itemHit = item;
@@ -1933,12 +2661,35 @@ TEHandle TENew(const Rect* destRect, const Rect* viewRect) {
 using HorizAlign = ResourceDASM::BitmapFontRenderer::HorizontalAlignment;
 
 struct StyledTextEdit {
+  // Color drawn behind the text. See the comment in render_line.
+  static constexpr uint32_t BACKGROUND_COLOR = 0xF3E5ABFF;
+  // Number of lines above and below the view rect that stay cached, so that
+  // scrolling back and forth by small amounts doesn't re-render them
+  static constexpr size_t OVERSCAN_LINES = 4;
+
   phosg::PrefixedLogger log;
-  std::string text;
+  TextGapBuffer text;
+  size_t insert_offset = 0;
   Rect layout_rect;
   Rect view_rect;
   HorizAlign align;
-  std::unique_ptr<phosg::ImageRGBA8888N> prerendered;
+
+  // The line-break table is built lazily the first time the text is drawn,
+  // and then updated incrementally when text is inserted. Rendered lines are
+  // kept in a ring with room for the lines in the view rect plus the overscan
+  // on each side; line N can only be in slot N % line_cache.size(), so memory
+  // use depends on the view's height and not on the length of the text.
+  struct RenderedLine {
+    size_t line = NO_LINE;
+    phosg::ImageRGBA8888N image;
+  };
+  static constexpr size_t NO_LINE = static_cast<size_t>(-1);
+  std::optional<ResourceDASM::BitmapFontRenderer> renderer;
+  TextLineLayout layout;
+  bool layout_valid = false;
+  size_t line_height = 0;
+  std::vector<RenderedLine> line_cache;
+  phosg::ImageRGBA8888N scroll_buffer;
 
   static std::unordered_set<const StyledTextEdit*> all_instances;
 
@@ -1968,6 +2719,183 @@ struct StyledTextEdit {
     auto* ste = reinterpret_cast<StyledTextEdit*>(ptr);
     return StyledTextEdit::all_instances.count(ste) ? ste : nullptr;
   }
+
+  ResourceDASM::BitmapFontRenderer& get_renderer() {
+    if (!this->renderer) {
+      auto font = load_font(1601); // Theldrow
+      if (!std::holds_alternative<ResourceDASM::BitmapFontRenderer>(font)) {
+        throw std::logic_error("Theldrow is not a bitmap font");
+      }
+      this->renderer = std::move(std::get<ResourceDASM::BitmapFontRenderer>(font));
+      this->line_height = this->renderer->pixel_dimensions_for_text(" ").second;
+    }
+    return *this->renderer;
+  }
+
+  size_t layout_width() const {
+    return this->layout_rect.right - this->layout_rect.left;
+  }
+
+  TextLineLayout::MeasureFn measure_fn() {
+    auto& renderer = this->get_renderer();
+    return [&renderer](const std::string& s) -> size_t {
+      return renderer.pixel_dimensions_for_text(s).first;
+    };
+  }
+
+  // Forgets rendered lines in [first_line, end_line)
+  void invalidate_rendered_lines(size_t first_line = 0, size_t end_line = NO_LINE) {
+    for (auto& entry : this->line_cache) {
+      if (entry.line != NO_LINE && entry.line >= first_line && entry.line < end_line) {
+        entry.line = NO_LINE;
+      }
+    }
+  }
+
+  void update_layout() {
+    if (!this->layout_valid) {
+      this->layout.reflow_all(this->text, this->layout_width(), this->measure_fn());
+      this->invalidate_rendered_lines();
+      this->layout_valid = true;
+      this->log.debug_f("Laid out {} bytes of text in {} lines", this->text.size(), this->layout.num_lines());
+    }
+  }
+
+  void insert(const std::string& data) {
+    size_t offset = this->insert_offset;
+    this->text.insert(offset, data.data(), data.size());
+    this->insert_offset += data.size();
+    if (!this->layout_valid) {
+      return;
+    }
+
+    // Re-flow only the lines affected by the insertion, and keep the rendered
+    // images of all the lines whose text and position didn't change. (Lines
+    // after the changed range that moved to a different index would also land
+    // in a different cache slot, so those are discarded too.)
+    auto changed = this->layout.reflow_after_edit(this->text, offset, 0, data.size(), this->layout_width(), this->measure_fn());
+    this->invalidate_rendered_lines(changed.first_line, changed.line_count_changed ? NO_LINE : changed.end_line);
+    this->log.debug_f("Inserted {} bytes; re-flowed lines [{}, {}) of {}",
+        data.size(), changed.first_line, changed.end_line, this->layout.num_lines());
+  }
+
+  const phosg::ImageRGBA8888N& render_line(size_t line) {
+    if (this->line_cache.empty()) {
+      size_t view_h = std::max<int16_t>(this->view_rect.bottom - this->view_rect.top, 0);
+      // A view rect that doesn't start on a line boundary shows a partial line
+      // at the top and bottom, hence the + 2
+      this->line_cache.resize((view_h / this->line_height) + 2 + 2 * OVERSCAN_LINES);
+    }
+    auto& entry = this->line_cache[line % this->line_cache.size()];
+    if (entry.line != line) {
+      auto& renderer = this->get_renderer();
+      std::string line_text = this->layout.line_text(this->text, line);
+      size_t w = this->layout_width();
+      size_t text_w = renderer.pixel_dimensions_for_text(line_text).first;
+      size_t x = 0;
+      if (text_w < w) {
+        if (this->align == HorizAlign::CENTER) {
+          x = (w - text_w) / 2;
+        } else if (this->align == HorizAlign::RIGHT) {
+          x = w - text_w;
+        }
+      }
+      // TODO: There is apparently a bug that causes the background not to be
+      // erased properly, so the text renders over itself as it scrolls and
+      // quickly becomes unreadable. To work around this, we add a background to
+      // the text that's sort of parchment-colored (in keeping with the game's
+      // theme), but it'd be nice to fix this and restore the original behavior.
+      if (entry.image.get_width() != w || entry.image.get_height() != this->line_height) {
+        entry.image.resize(w, this->line_height);
+      }
+      entry.image.write_rect(0, 0, w, this->line_height, BACKGROUND_COLOR);
+      renderer.render_text(entry.image, line_text, x, 0, w, this->line_height, 0x000000FF);
+      entry.line = line;
+    }
+    return entry.image;
+  }
+
+  // Returns the part of the view rect that is within the port's bounds
+  Rect visible_view_rect(const CCGrafPort& port) const {
+    Rect port_bounds{0, 0, static_cast<int16_t>(port.get_height()), static_cast<int16_t>(port.get_width())};
+    Rect ret;
+    SectRect(&this->view_rect, &port_bounds, &ret);
+    return ret;
+  }
+
+  // Draws the part of the text that falls within clip_rect, which must be
+  // within the visible view rect
+  void draw_lines(CCGrafPort& port, const Rect& clip_rect) {
+    if (clip_rect.top >= clip_rect.bottom || clip_rect.left >= clip_rect.right) {
+      return;
+    }
+    port.erase_rect(clip_rect);
+    this->update_layout();
+    if (this->line_height == 0) {
+      return;
+    }
+
+    int32_t first_line = (clip_rect.top - this->layout_rect.top) / static_cast<int32_t>(this->line_height);
+    for (size_t line = std::max<int32_t>(first_line, 0); line < this->layout.num_lines(); line++) {
+      Rect line_rect{
+          static_cast<int16_t>(this->layout_rect.top + line * this->line_height),
+          this->layout_rect.left,
+          static_cast<int16_t>(this->layout_rect.top + (line + 1) * this->line_height),
+          this->layout_rect.right};
+      if (line_rect.top >= clip_rect.bottom) {
+        break;
+      }
+      Rect dest_rect;
+      if (!SectRect(&line_rect, &clip_rect, &dest_rect)) {
+        continue;
+      }
+      port.data.copy_from(
+          this->render_line(line),
+          dest_rect.left,
+          dest_rect.top,
+          dest_rect.right - dest_rect.left,
+          dest_rect.bottom - dest_rect.top,
+          dest_rect.left - line_rect.left,
+          dest_rect.top - line_rect.top);
+    }
+  }
+
+  // Moves the already-drawn text within the view rect by (dh, dv), then draws
+  // only the strips that were uncovered
+  void scroll_drawn_text(CCGrafPort& port, int16_t dh, int16_t dv) {
+    Rect vis = this->visible_view_rect(port);
+    int16_t vis_w = vis.right - vis.left;
+    int16_t vis_h = vis.bottom - vis.top;
+    if (vis_w <= 0 || vis_h <= 0) {
+      return;
+    }
+    if (std::abs(dh) >= vis_w || std::abs(dv) >= vis_h) {
+      this->draw_lines(port, vis);
+      return;
+    }
+
+    // The source and destination overlap, so copy through a separate buffer
+    size_t copy_w = vis_w - std::abs(dh);
+    size_t copy_h = vis_h - std::abs(dv);
+    size_t src_x = vis.left + std::max<int16_t>(-dh, 0);
+    size_t src_y = vis.top + std::max<int16_t>(-dv, 0);
+    if (this->scroll_buffer.get_width() != copy_w || this->scroll_buffer.get_height() != copy_h) {
+      this->scroll_buffer.resize(copy_w, copy_h);
+    }
+    this->scroll_buffer.copy_from(port.data, 0, 0, copy_w, copy_h, src_x, src_y);
+    port.data.copy_from(this->scroll_buffer, src_x + dh, src_y + dv, copy_w, copy_h, 0, 0);
+
+    if (dv > 0) {
+      this->draw_lines(port, Rect{vis.top, vis.left, static_cast<int16_t>(vis.top + dv), vis.right});
+    } else if (dv < 0) {
+      this->draw_lines(port, Rect{static_cast<int16_t>(vis.bottom + dv), vis.left, vis.bottom, vis.right});
+    }
+    if (dh > 0) {
+      this->draw_lines(port, Rect{vis.top, vis.left, vis.bottom, static_cast<int16_t>(vis.left + dh)});
+    } else if (dh < 0) {
+      this->draw_lines(port, Rect{vis.top, static_cast<int16_t>(vis.right + dh), vis.bottom, vis.right});
+    }
+  }
 };
 
 std::unordered_set<const StyledTextEdit*> StyledTextEdit::all_instances;
@@ -2012,29 +2940,6 @@ void TEUpdateUnstyled(const Rect& r, TEHandle te) {
 
 void TEUpdateStyled(const Rect& r, StyledTextEdit* ste) {
   ste->log.debug_f("TEUpdateStyled({{x0={}, y0={}, x1={}, y1={}}})", r.left, r.top, r.right, r.bottom);
-  if (!ste->prerendered) {
-    ste->log.debug_f("Prerendered text is missing; generating it");
-    auto font = load_font(1601); // Theldrow
-    if (!std::holds_alternative<ResourceDASM::BitmapFontRenderer>(font)) {
-      throw std::logic_error("Theldrow is not a bitmap font");
-    }
-    const auto& bm_font = std::get<ResourceDASM::BitmapFontRenderer>(font);
-    ste->prerendered = std::make_unique<phosg::ImageRGBA8888N>(
-        bm_font.wrap_and_render_text<phosg::PixelFormat::RGBA8888_NATIVE>(
-            ste->text, ste->layout_rect.right - ste->layout_rect.left, 0, 0x000000FF, ste->align));
-    // TODO: There is apparently a bug that causes the background not to be
-    // erased properly, so the text renders over itself as it scrolls and
-    // quickly becomes unreadable. To work around this, we add a background to
-    // the text that's sort of parchment-colored (in keeping with the game's
-    // theme), but it'd be nice to fix this and restore the original behavior.
-    for (size_t y = 0; y < ste->prerendered->get_height(); y++) {
-      for (size_t x = 0; x < ste->prerendered->get_width(); x++) {
-        if (!phosg::get_a(ste->prerendered->read(x, y))) {
-          ste->prerendered->write(x, y, 0xF3E5ABFF);
-        }
-      }
-    }
-  }
   auto* port = CCGrafPort::as_port(qd.thePort);
   if (!port) {
     wm_log.warning_f("TEUpdateStyled: current port is missing; cannot draw text");
@@ -2042,18 +2947,9 @@ void TEUpdateStyled(const Rect& r, StyledTextEdit* ste) {
     ste->log.debug_f("Rendering into {} with layout={{x0={}, y0={}, x1={}, y1={}}}, view={{x0={}, y0={}, x1={}, y1={}}}",
         port->ref(), ste->layout_rect.left, ste->layout_rect.top, ste->layout_rect.right, ste->layout_rect.bottom,
         ste->view_rect.left, ste->view_rect.top, ste->view_rect.right, ste->view_rect.bottom);
-    port->erase_rect(ste->view_rect);
-    port->data.copy_from(
-        *ste->prerendered,
-        ste->view_rect.left,
-        ste->view_rect.top,
-        ste->view_rect.right - ste->view_rect.left,
-        ste->view_rect.bottom - ste->view_rect.top,
-        ste->view_rect.left - ste->layout_rect.left,
-        ste->view_rect.top - ste->layout_rect.top,
-        ste->layout_rect.right - ste->layout_rect.left,
-        ste->layout_rect.bottom - ste->layout_rect.top,
-        phosg::ResizeMode::NONE); // Clip if out of bounds
+    // Only the lines that intersect the view rect are rendered (or reused from
+    // an earlier update), so this doesn't depend on the length of the text
+    ste->draw_lines(*port, ste->visible_view_rect(*port));
   }
 }
 
@@ -2070,14 +2966,16 @@ void TEStyleInsert(const void* text_v, int32_t length, StScrpHandle hSt, TEHandl
   // This function should only be used with styled TextEdit instances
   auto* ste = StyledTextEdit::from_void(te);
   const char* text = reinterpret_cast<const char*>(text_v);
-  ste->text.clear();
-  ste->text.reserve(length);
+  std::string data;
+  data.reserve(length);
   for (size_t z = 0; z < length; z++) {
     char ch = text[z];
-    ste->text.push_back((ch == '\r') ? '\n' : ch);
+    data.push_back((ch == '\r') ? '\n' : ch);
   }
-  ste->log.debug_f("TEStyleInsert(\"{}\")", ste->text);
-  ste->prerendered.reset();
+  ste->log.debug_f("TEStyleInsert(\"{}\")", data);
+  // Like the original TEStyleInsert, this inserts the text at the insertion
+  // point (which is the end of the text, since we don't support selection)
+  ste->insert(data);
   // TODO: We currently don't implement styled text. It'd be nice to support
   // this in the future, but TTF fonts make this difficult - there aren't
   // functions that make it easy to render heterogenously-styled text in
@@ -2102,7 +3000,8 @@ void TESetAlignment(int16_t just, TEHandle te) {
     default:
       throw std::logic_error("Invalid text alignment mode");
   }
-  ste->prerendered.reset();
+  // Alignment doesn't affect where lines are broken, only how they're drawn
+  ste->invalidate_rendered_lines();
 }
 
 void TEScroll(int16_t dh, int16_t dv, TEHandle te) {
@@ -2116,7 +3015,11 @@ void TEScroll(int16_t dh, int16_t dv, TEHandle te) {
       dh, dv,
       ste->layout_rect.left, ste->layout_rect.top, ste->layout_rect.right, ste->layout_rect.bottom,
       ste->view_rect.left, ste->view_rect.top, ste->view_rect.right, ste->view_rect.bottom);
-  // NOTE: TEScroll is supposed to update the text displayed on screen (that
-  // is, render the text to the current port), but Realmz always calls TEUpdate
-  // shortly after TEScroll, so as an optimization, we don't render here.
+  // Like the original TEScroll, this moves the text that's already drawn and
+  // only draws the newly-exposed part of the view rect. This assumes the text
+  // was up to date in the current port, which is also what the original did.
+  auto* port = CCGrafPort::as_port(qd.thePort);
+  if (port) {
+    ste->scroll_drawn_text(*port, dh, dv);
+  }
 }
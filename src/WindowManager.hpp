@@ -22,6 +22,7 @@ private:
   int16_t window_kind;
   bool visible;
   bool is_dialog_flag;
+  int32_t template_id; // DLOG resource ID this window was created from, or NO_TEMPLATE_ID
   std::vector<std::shared_ptr<DialogItem>> dialog_items; // All items (the below 3 vectors are disjoint subsets of this)
   std::vector<std::shared_ptr<DialogItem>> static_items;
   std::vector<std::shared_ptr<DialogItem>> control_items;
@@ -30,6 +31,44 @@ private:
   std::shared_ptr<Window> window_below;
   std::shared_ptr<Window> window_above;
 
+  // Everything outside of the dialog items that affects how they're rendered.
+  // If any of this changes, the retained image can't be reused.
+  struct RenderSignature {
+    int16_t tx_font;
+    int16_t tx_size;
+    int16_t tx_face;
+    int16_t pn_mode;
+    uint32_t fg_color;
+    uint32_t bg_color;
+    const void* bk_pix_pat;
+    uint64_t param_text_generation;
+    size_t width;
+    size_t height;
+
+    bool operator==(const RenderSignature&) const = default;
+  };
+
+  // The port's contents as of the end of the last erase_and_render call
+  phosg::ImageRGBA8888N retained_image;
+  RenderSignature retained_signature;
+  bool retained_image_valid = false;
+
+  // Uniform grid over the dialog items' rects, used by
+  // dialog_item_for_position. The items overlapping cell N are
+  // item_indexes[cell_offsets[N]] through item_indexes[cell_offsets[N + 1] - 1],
+  // in the same order as in dialog_items. Rebuilt lazily after any item is
+  // added, removed, moved or resized.
+  struct HitGrid {
+    Rect bounds;
+    int16_t cell_size = 0;
+    size_t cols = 0;
+    size_t rows = 0;
+    std::vector<uint32_t> cell_offsets;
+    std::vector<uint32_t> item_indexes;
+  };
+  HitGrid hit_grid;
+  bool hit_grid_valid = false;
+
   Window(
       const std::string& title,
       const Rect& bounds,
@@ -39,7 +78,11 @@ private:
       const RGBColor& background_color,
       std::vector<std::shared_ptr<DialogItem>>&& dialog_items);
 
+  void sort_dialog_items();
+
 public:
+  static constexpr int32_t NO_TEMPLATE_ID = 0x00010000;
+
   static std::shared_ptr<Window> make_shared(
       const std::string& title,
       const Rect& bounds,
@@ -83,7 +126,30 @@ public:
   TEHandle add_text_edit(const Rect& dest_rect, const Rect& view_rect);
   void remove_text_edit(std::shared_ptr<DialogItem> item);
 
+  void invalidate_retained_image();
+  void invalidate_hit_grid();
+
+  // These are used to keep a disposed dialog around to be reused the next time
+  // the same DLOG is opened. release_dialog_items is called when the dialog
+  // is disposed, and reinitialize puts it back into the state that a newly
+  // constructed Window would have.
+  void release_dialog_items();
+  void reinitialize(
+      const std::string& title,
+      const Rect& bounds,
+      int16_t window_kind,
+      bool visible,
+      const RGBColor& background_color,
+      std::vector<std::shared_ptr<DialogItem>>&& dialog_items);
+
   friend class WindowManager;
+
+private:
+  RenderSignature current_render_signature() const;
+  void save_retained_image();
+  void render_all_items();
+  void render_dirty_items();
+  void rebuild_hit_grid();
 };
 
 class WindowManager {
@@ -91,16 +157,28 @@ public:
   CCGrafPort screen_port;
 
 private:
-  std::unordered_map<DialogItemHandle, std::shared_ptr<DialogItem>> dialog_items_by_handle;
   // TODO(fuzziqersoftware): It'd be nice to get rid of this map and treat Windows similarly to CCGrafPorts. This is
   // nontrivial because Window inherits from std::enable_shared_from_this, which has a private field and could cause
   // Window to no longer be standard layout, which would break compatibility with C code.
   std::unordered_map<WindowPtr, std::shared_ptr<Window>> port_to_window;
   std::shared_ptr<Window> top_window;
   std::shared_ptr<Window> bottom_window;
+  // Disposed dialogs that can be reused by create_window, oldest first
+  std::vector<std::shared_ptr<Window>> parked_windows;
+  // The windows' bounds in stacking order (top first), used by
+  // window_for_point. Rebuilt lazily after the stack changes or any window
+  // moves or resizes.
+  std::vector<std::pair<Rect, std::shared_ptr<Window>>> window_hit_list;
+  bool window_hit_list_valid = false;
   sdl_window_shared sdl_window;
   bool text_editing_active = false;
   bool recomposite_enabled = true;
+  // If nonzero, recomposites within this long of the last present (in real
+  // time) update screen_port but don't present it; the latest result is
+  // presented by present_if_pending or the next recomposite after that
+  uint64_t min_present_interval_ns = 0;
+  uint64_t last_present_ns = 0;
+  bool present_pending = false;
 
   WindowManager();
 
@@ -117,7 +195,8 @@ public:
       uint32_t ref_con,
       bool is_dialog,
       const RGBColor& background_color,
-      std::vector<std::shared_ptr<DialogItem>>&& dialog_items);
+      std::vector<std::shared_ptr<DialogItem>>&& dialog_items,
+      int32_t template_id = Window::NO_TEMPLATE_ID);
   void destroy_window(WindowPtr port);
   std::shared_ptr<Window> window_for_port(WindowPtr port);
   std::shared_ptr<DialogItem> dialog_item_for_handle(DialogItemHandle handle);
@@ -126,6 +205,7 @@ public:
   void unlink_window(std::shared_ptr<Window> window);
   void bring_to_front(std::shared_ptr<Window> window);
   std::shared_ptr<Window> window_for_point(ssize_t x, ssize_t y);
+  void invalidate_window_hit_list();
 
   void on_dialog_item_focus_changed();
 
@@ -139,6 +219,12 @@ public:
   void recomposite_from_window(std::shared_ptr<Window> updated_window);
   void recomposite_all();
 
+  void set_min_present_interval_ns(uint64_t ns);
+  // Presents the last recomposited frame if it wasn't presented because of
+  // min_present_interval_ns. The event loop calls this, so a frame skipped
+  // during a fast animation is still shown once the game waits for input.
+  void present_if_pending();
+
   inline sdl_window_shared get_sdl_window() const {
     return this->sdl_window;
   }
@@ -146,6 +232,7 @@ public:
   void on_debug_signal();
 
 private:
+  void present();
   void print_window_stack() const;
   void verify_window_stack() const;
 };
@@ -3,13 +3,12 @@
 
 /************** delay ***********************/
 void delay(short timedelay) {
-  long oldtick;
-
   if (!timedelay)
     timedelay = delayspeed;
-  oldtick = TickCount();
 
-  for (;;)
-    if (TickCount() - oldtick > timedelay)
-      return;
+  /* *** CHANGED FROM ORIGINAL IMPLEMENTATION ***
+   * The original implementation spun on TickCount until more than timedelay
+   * ticks had passed, which kept a CPU core busy for the entire delay. We
+   * sleep until the same tick instead. */
+  DelayUntilTick(TickCount() + timedelay + 1);
 }
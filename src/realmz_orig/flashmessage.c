@@ -77,8 +77,10 @@ void flashmessage(Str255 strc, short x, short y, short duration, short toplay) /
   if (duration > 0) {
     oldtick = TickCount();
 
-    while (oldtick + duration != TickCount()) {
-    }
+    /* *** CHANGED FROM ORIGINAL IMPLEMENTATION ***
+     * The original implementation spun until TickCount reached the target
+     * tick; we sleep until then instead. */
+    DelayUntilTick(oldtick + duration);
   } else if (duration < 0) {
     if (putup) {
       putup = FALSE;
@@ -2028,7 +2028,12 @@ over:
       warn(21);
 
     tickcheck();
-    SystemTask();
+    /* *** CHANGED FROM ORIGINAL IMPLEMENTATION ***
+     * The original implementation called SystemTask here, so this loop ran
+     * continuously while the game was idle, just to find out when it was time
+     * for tickcheck to animate the torches. tickcheck now schedules a wakeup
+     * for that, so we can wait for input (or mouse movement) until then. */
+    WaitForInput();
     a = GetNextEvent(everyEvent, &gTheEvent);
 #ifdef PC // Myriad
     DoCorrectBugMADRepeat();
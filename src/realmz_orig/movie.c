@@ -91,9 +91,10 @@ backtoit:
     EraseRect(&lookrect);
     TEUpdate(&txtRect, textHand); // � Draw text in viewRect.
     CopyBits(src, dst, &lookrect, &lookrect, 0, NIL);
-    do {
-
-    } while (TickCount() < newcount + 3);
+    /* *** CHANGED FROM ORIGINAL IMPLEMENTATION ***
+     * The original implementation spun until TickCount reached
+     * newcount + 3; we sleep until then instead. */
+    DelayUntilTick(newcount + 3);
 
     SystemTask();
     x = GetNextEvent(everyEvent, &gTheEvent);
@@ -41,7 +41,11 @@ over:
   FlushEvents(everyEvent, 0);
 
   for (;;) {
-    WaitNextEvent(everyEvent, &gTheEvent, 0L, 0L);
+    /* *** CHANGED FROM ORIGINAL IMPLEMENTATION ***
+     * The original code passed 0 for the sleep time, so this loop spun while
+     * waiting for input. WaitNextEvent returns as soon as an event arrives, so
+     * a longer sleep doesn't delay anything. */
+    WaitNextEvent(everyEvent, &gTheEvent, 60L, 0L);
 #ifdef PC // Myriad
     DoCorrectBugMADRepeat();
 #endif
@@ -150,7 +154,9 @@ short question2(short prompt1, short prompt2) {
   FlushEvents(everyEvent, 0);
 
   for (;;) {
-    WaitNextEvent(everyEvent, &gTheEvent, 0L, 0L);
+    /* *** CHANGED FROM ORIGINAL IMPLEMENTATION ***
+     * Sleep time was 0; see the note in question(). */
+    WaitNextEvent(everyEvent, &gTheEvent, 60L, 0L);
 #ifdef PC // Myriad
     DoCorrectBugMADRepeat();
 #endif
@@ -245,7 +251,9 @@ short question3(Str255 p1, Str255 p2) {
   FlushEvents(everyEvent, 0);
 
   for (;;) {
-    WaitNextEvent(everyEvent, &gTheEvent, 0L, 0L);
+    /* *** CHANGED FROM ORIGINAL IMPLEMENTATION ***
+     * Sleep time was 0; see the note in question(). */
+    WaitNextEvent(everyEvent, &gTheEvent, 60L, 0L);
 #ifdef PC // Myriad
     DoCorrectBugMADRepeat();
 #endif
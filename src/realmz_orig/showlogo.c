@@ -77,9 +77,15 @@ void delay2(short timedelay) {
     timedelay = delayspeed;
   oldtick = TickCount();
 
-  while (!Button())
+  /* *** CHANGED FROM ORIGINAL IMPLEMENTATION ***
+   * The original implementation checked the button and the tick count in a
+   * tight loop. We sleep for a tick between checks so this doesn't keep a CPU
+   * core busy. */
+  while (!Button()) {
     if (TickCount() - oldtick > timedelay)
       return;
+    Delay(1, NULL);
+  }
 }
 
 /***************** hideMenuBar *********************************/
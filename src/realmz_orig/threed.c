@@ -554,8 +554,10 @@ move:
             floorx += deltax;
             floory += deltay;
           }
-          while (TickCount() < checktime + 15) {
-          }
+          /* *** CHANGED FROM ORIGINAL IMPLEMENTATION ***
+           * The original implementation spun until TickCount reached
+           * checktime + 15; we sleep until then instead. */
+          DelayUntilTick(checktime + 15);
 
           cancelkey = key;
           key = 0;
@@ -33,6 +33,12 @@ void tickcheck(void) {
     flamestage++;
     if (flamestage > 7)
       flamestage = 0;
+
+    /* *** CHANGED FROM ORIGINAL IMPLEMENTATION ***
+     * The main screen loop now waits for input instead of polling (see
+     * mainscreen()), so make sure it wakes up in time for the next frame of the
+     * torch animation. */
+    WakeEventLoopAtTick(oldflametick + 11);
   }
 }
 
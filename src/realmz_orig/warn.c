@@ -88,7 +88,11 @@ void warn(short string) {
   FlushEvents(everyEvent, 0);
 
   for (;;) {
-    WaitNextEvent(everyEvent, &gTheEvent, 0L, 0L);
+    /* *** CHANGED FROM ORIGINAL IMPLEMENTATION ***
+     * The original code passed a sleep time of 0, which made this loop poll
+     * continuously until the player clicked or pressed a key. Any event still
+     * ends the wait immediately. */
+    WaitNextEvent(everyEvent, &gTheEvent, 60L, 0L);
 #ifdef PC // Myriad
     DoCorrectBugMADRepeat();
 #endif
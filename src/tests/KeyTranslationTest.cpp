@@ -0,0 +1,48 @@
+#include <SDL3/SDL_keycode.h>
+#include <SDL3/SDL_scancode.h>
+
+#include <phosg/Strings.hh>
+#include <vector>
+
+#include "EventManager.hpp"
+
+// Checks that the precomputed key translation tables used by the event pump
+// produce the same messages as translating through the source tables directly
+
+int main() {
+  std::vector<SDL_Keycode> keys;
+  for (SDL_Keycode key = 0; key < 0x100; key++) {
+    keys.emplace_back(key);
+  }
+  for (SDL_Keycode scancode = 0; scancode < SDL_SCANCODE_COUNT + 0x10; scancode++) {
+    keys.emplace_back(SDLK_SCANCODE_MASK | scancode);
+  }
+  // Some keys that aren't in either range, and shouldn't translate to anything
+  keys.emplace_back(SDLK_EXTENDED_MASK | 0x01);
+  keys.emplace_back(0x00010000);
+  keys.emplace_back(0xFFFFFFFF);
+
+  size_t num_mapped = 0;
+  size_t num_errors = 0;
+  for (SDL_Keycode key : keys) {
+    for (uint32_t modifier_flags = 0; modifier_flags < 0x10000; modifier_flags += 0x80) {
+      uint32_t expected = mac_message_for_sdl_key_code_reference(key, modifier_flags);
+      uint32_t actual = mac_message_for_sdl_key_code(key, modifier_flags);
+      if (actual != expected) {
+        phosg::log_error_f("Key {:08X} with modifiers {:04X}: expected {:08X}, received {:08X}",
+            key, modifier_flags, expected, actual);
+        num_errors++;
+      }
+      if (expected && !modifier_flags) {
+        num_mapped++;
+      }
+    }
+  }
+
+  if (num_errors) {
+    phosg::log_error_f("{} mismatches", num_errors);
+    return 1;
+  }
+  phosg::log_info_f("All translations match ({} keys mapped)", num_mapped);
+  return 0;
+}
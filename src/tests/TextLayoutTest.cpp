@@ -0,0 +1,143 @@
+#include <format>
+#include <phosg/Strings.hh>
+#include <random>
+#include <string>
+
+#include "TextEdit.hpp"
+
+// Applies random inserts and erases to a TextGapBuffer and checks that after
+// each one, incrementally re-flowing the layout produces the same line breaks
+// as wrapping the entire text from scratch
+
+static size_t measure(const std::string& text) {
+  // Proportional, so that breaks depend on which characters are on each line
+  size_t width = 0;
+  for (char ch : text) {
+    width += (ch == 'i' || ch == ' ') ? 3 : (ch == 'm' || ch == 'W') ? 9 : 6;
+  }
+  return width;
+}
+
+static std::string random_text(std::mt19937& rng, size_t max_size) {
+  // Plenty of narrow characters, so that short lines often leave room for
+  // part of a long word that follows them
+  static const char alphabet[] = "aaeeiiiiimnorstW      \n";
+  std::string ret;
+  size_t size = rng() % (max_size + 1);
+  if (rng() % 10 == 0) {
+    // Occasionally insert a word too long for any line, to exercise breaking
+    // within a word
+    ret.assign(size * 4, 'm');
+  } else {
+    for (size_t z = 0; z < size; z++) {
+      ret.push_back(alphabet[rng() % (sizeof(alphabet) - 1)]);
+    }
+  }
+  return ret;
+}
+
+static bool layouts_match(const TextLineLayout& actual, const TextLineLayout& expected, const std::string& context) {
+  bool match = (actual.num_lines() == expected.num_lines());
+  for (size_t z = 0; match && z < expected.num_lines(); z++) {
+    match = (actual.line_start(z) == expected.line_start(z));
+  }
+  if (!match) {
+    std::string actual_str, expected_str;
+    for (size_t z = 0; z < actual.num_lines(); z++) {
+      actual_str += std::format(" {}", actual.line_start(z));
+    }
+    for (size_t z = 0; z < expected.num_lines(); z++) {
+      expected_str += std::format(" {}", expected.line_start(z));
+    }
+    phosg::log_error_f("{}: expected line starts{}; received{}", context, expected_str, actual_str);
+  }
+  return match;
+}
+
+// Makes 1000 random edits to an initially empty text, checking the layout
+// after each one. Returns the number of mismatches.
+static size_t check_random_edits(uint32_t seed, size_t max_width) {
+  std::mt19937 rng(seed);
+  TextGapBuffer text;
+  std::string reference;
+  TextLineLayout layout;
+  layout.reflow_all(text, max_width, measure);
+
+  size_t num_errors = 0;
+  for (size_t edit_index = 0; edit_index < 1000; edit_index++) {
+    // Edits at line breaks are the ones most likely to change earlier lines,
+    // so some edits go exactly at the start of a line
+    size_t pos = reference.empty() ? 0 : (rng() % (reference.size() + 1));
+    if (rng() % 4 == 0) {
+      pos = layout.line_start(rng() % layout.num_lines());
+    }
+    size_t removed_size = 0;
+    size_t inserted_size = 0;
+    // Favor inserts so the text grows to span many lines
+    if ((rng() % 3 == 0) && (pos < reference.size())) {
+      removed_size = 1 + rng() % std::min<size_t>(reference.size() - pos, 20);
+      text.erase(pos, removed_size);
+      reference.erase(pos, removed_size);
+    } else {
+      auto inserted = random_text(rng, 12);
+      inserted_size = inserted.size();
+      text.insert(pos, inserted.data(), inserted.size());
+      reference.insert(pos, inserted);
+    }
+    layout.reflow_after_edit(text, pos, removed_size, inserted_size, max_width, measure);
+
+    if (text.str() != reference) {
+      phosg::log_error_f("Seed {}, width {}, edit {}: buffer contents do not match", seed, max_width, edit_index);
+      return num_errors + 1;
+    }
+    TextLineLayout expected;
+    expected.reflow_all(text, max_width, measure);
+    if (!layouts_match(layout, expected, std::format("Seed {}, width {}, edit {}", seed, max_width, edit_index))) {
+      num_errors++;
+      // Start over from a correct layout so one mismatch isn't reported for
+      // every edit after it
+      layout = expected;
+    }
+  }
+  return num_errors;
+}
+
+// An edit that shortens a word broken across several lines can pull text
+// back more than one line. Here the long word doesn't fit after "i " at
+// first, but does after the edit splits it.
+static size_t check_mid_word_break() {
+  constexpr size_t max_width = 150;
+  TextGapBuffer text("i mmmmmmmmmmmmmmmmms t  ");
+  TextLineLayout layout;
+  layout.reflow_all(text, max_width, measure);
+  static const std::string inserted = " eai ";
+  text.insert(18, inserted.data(), inserted.size());
+  auto changed = layout.reflow_after_edit(text, 18, 0, inserted.size(), max_width, measure);
+
+  TextLineLayout expected;
+  expected.reflow_all(text, max_width, measure);
+  size_t num_errors = layouts_match(layout, expected, "Mid-word break") ? 0 : 1;
+  if (changed.first_line != 0) {
+    phosg::log_error_f("Mid-word break: expected the change to start at line 0, but it starts at line {}", changed.first_line);
+    num_errors++;
+  }
+  return num_errors;
+}
+
+int main() {
+  size_t num_errors = check_mid_word_break();
+  size_t num_runs = 0;
+  for (uint32_t seed = 1; seed <= 16; seed++) {
+    for (size_t max_width : {1, 20, 64, 150, 400}) {
+      num_errors += check_random_edits(seed, max_width);
+      num_runs++;
+    }
+  }
+
+  if (num_errors) {
+    phosg::log_error_f("{} mismatches", num_errors);
+    return 1;
+  }
+  phosg::log_info_f("All layouts match ({} runs of random edits)", num_runs);
+  return 0;
+}